@@ -1,6 +1,8 @@
 import re
+import sys
 
-with open('input.txt') as f:
+# Read the file named on the command line, or input.txt
+with open(sys.argv[1] if len(sys.argv) > 1 else 'input.txt') as f:
     string = f.read()
 
 tups = re.findall(r"\(\s*(\S+)\s*,\s*(\S+)\s*,\s*(\S+)\s*\)", string)
@@ -3,13 +3,12 @@
 #include <string.h>
 #include <stdbool.h>
 
-#define DEBUG 1
+#define DEBUG 0
 
 typedef struct
 {
-    int id;
     char *topic;
-    int accum_score; // This ID's accumulated score for this topic.
+    int accum_score; // The current ID's accumulated score for this topic.
 } score_entry_t;
 
 typedef enum
@@ -19,6 +18,49 @@ typedef enum
     SCORE_idx
 } TokenIndex;
 
+// Topics of the current ID. Input is grouped by ID, so this only ever holds
+// one user's topics, however long the input is.
+score_entry_t *score_entries = NULL;
+int score_entries_size = 0;
+int score_entries_capacity = 0;
+
+void add_score(const char *topic, int score)
+{
+    // Find the topic.
+    for (int i = 0; i < score_entries_size; i++)
+    {
+        if (strcmp(score_entries[i].topic, topic) == 0)
+        {
+            score_entries[i].accum_score += score;
+            return;
+        }
+    }
+
+    // A new topic for this ID.
+    if (score_entries_size == score_entries_capacity)
+    {
+        score_entries_capacity = score_entries_capacity ? score_entries_capacity * 2 : 16;
+        score_entries = realloc(score_entries, score_entries_capacity * sizeof *score_entries);
+    }
+
+    // The line buffer is reused for the next line, so keep a copy.
+    score_entries[score_entries_size++] = (score_entry_t){strdup(topic), score};
+}
+
+/**
+ * @brief Print the accumulated scores of an ID, and forget them.
+ */
+void emit_id(int id)
+{
+    for (int i = 0; i < score_entries_size; i++)
+    {
+        printf("(%d, %s, %d)\n", id, score_entries[i].topic, score_entries[i].accum_score);
+        free(score_entries[i].topic);
+    }
+
+    score_entries_size = 0;
+}
+
 int main(void)
 {
     // Buffer to hold lines as they come in via stdin.
@@ -28,27 +70,27 @@ int main(void)
     const char delims[] = "(), \n";
 
     TokenIndex token_idx = ID_idx;
-    score_entry_t score_entries[100];
-    int score_entries_size = 0;
 
-    while (true)
-    {
-        // Get next line, delimited by newline.
-        fgets(text, TEXT_BUF_SIZE, stdin);
+    // The ID whose topics are in score_entries.
+    int current_id = 0;
+    bool have_id = false;
+
+    // Temp variables to construct the entry
+    int id;
+    char *topic;
+    int score;
 
+    // Get next line, delimited by newline, until there is nothing else to
+    // read.
+    while (fgets(text, TEXT_BUF_SIZE, stdin) != NULL)
+    {
 #if DEBUG
         printf("Got \"%s\"\n", text);
 #endif
 
-        // If there is nothing else to read, we're done.
+        // The mapper ends its output with this.
         if (strcmp(text, "Done.\n") == 0)
             break;
-        
-
-        // Temp variables to construct the entry
-        int id;
-        char *topic;
-        int score;
 
         // Otherwise, parse the tokens.
         // Get first token.
@@ -61,7 +103,7 @@ int main(void)
             {
             case ID_idx:
                 id = atoi(token);
-                token_idx == TOPIC_idx;
+                token_idx = TOPIC_idx;
                 break;
 
             case TOPIC_idx:
@@ -72,17 +114,15 @@ int main(void)
             case SCORE_idx:
                 score = atoi(token);
 
-                // Construct the entry
-                score_entries[score_entries_size++] = (score_entry_t){
-                    id, topic, score
-                };
+                // If the user changes, print the previous user's accumulated
+                // value tuples and start over.
+                if (have_id && id != current_id)
+                    emit_id(current_id);
 
+                current_id = id;
+                have_id = true;
 
-                // Iterate through each entry in score_entries.
-                // If the topic changes, print the accumulated value tuple.
-                // If the user changes, start over from the beginning.
-                
-
+                add_score(topic, score);
 
                 token_idx = ID_idx;
                 break;
@@ -92,7 +132,13 @@ int main(void)
             token = strtok(NULL, delims);
         } // end of while (token != NULL)
 
-    } // end of while (true)
+    } // end of while (fgets)
+
+    // Finally, print out the last ID's entries.
+    if (have_id)
+        emit_id(current_id);
+
+    free(score_entries);
 
     printf("Done.\n");
 
@@ -1,24 +1,30 @@
+import sys
 
 # Keep track of ids
 users = {}
 
 
 # Get input
-while (input_ := input()):
+for input_ in sys.stdin:
+    if not input_.strip():
+        continue
+
     tup = eval(input_)  # Get as tuple
     # Format
     id_, topic, score = tup
 
-    if id_ in users:
-        user = users[id_]
-        
-        if topic in user:
-            user[topic] += score
-        else:
-            user[topic] = score
-        
-    else:
+    if id_ not in users:
         users[id_] = {}  # To store topics and scores
-    
-    
 
+    user = users[id_]
+
+    if topic in user:
+        user[topic] += score
+    else:
+        user[topic] = score
+
+
+# Output totals, in the order the users and topics were first seen
+for id_, user in users.items():
+    for topic, score in user.items():
+        print(f"({id_}, {topic}, {score})")
@@ -1,8 +1,24 @@
+#define _GNU_SOURCE // for close_range(), splice()
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <wait.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "partition.h"
+#include "record_frame.h"
+#include "uring_reader.h"
 
 #define DEBUG 0
 
@@ -12,154 +28,1108 @@
 #define MAPPER_PATH "./build/mapper"
 #define REDUCER_PATH "./build/reducer"
 
+// How much input the combiner moves into a mapper pipe per write().
+#define FEED_CHUNK_SIZE (64 * 1024)
+
+// Upper bound for -m and -r.
+#define MAX_PROCS 64
+
+// Mappers write to reducer j on file descriptor MAPPER_OUT_FD + j.
+#define MAPPER_OUT_FD 3
+
+// With -b, mappers send reducers binary frames instead of text.
+int binary = 0;
+
+// With -z, input moves into the mapper pipes with splice() and vmsplice()
+// instead of read() and write().
+int zero_copy = 0;
+
+// With -i, input files are read with io_uring.
+int use_uring = 0;
+
+// With -s <MiB>, reducers use an external sort-merge with this much memory.
+const char *sort_budget = NULL;
+
+// With -d <socket>, the combiner runs as a daemon: the mappers and reducers
+// are started once, and each client connection to the socket is one job.
+const char *daemon_socket = NULL;
+
+// With -f, mappers write their output to a memfd per reducer instead of a
+// pipe, and the reducers are started once all mappers are done.
+int handoff = 0;
+
+// With -t, the combiner measures every stage and reports on stderr, as JSON,
+// once the job is done.
+int telemetry = 0;
+
+/**
+ * @brief What the combiner measures of its own work.
+ */
+struct feed_stats
+{
+    long long bytes[MAX_PROCS]; // Sent to each mapper through comb2map.
+
+    // With -t, the comb2map pipes are non-blocking, and the time spent
+    // waiting for room in them is added up here.
+    long long blocked_ns;
+} feed_stats;
+
 /**
- * @brief Read a text file into a buffer.
- * WARNING: You must free() the returned char*!
+ * @brief A mapper or reducer, and what is known about it once it exits.
  */
-char *readTextFile(void)
+typedef struct child
 {
-    const int BUF_SIZE = 1500;
+    pid_t pid;
+    struct timespec started;
+    struct timespec ended; // When it was reaped.
+    int status;
+    struct rusage usage;
 
-    char *buffer = malloc(BUF_SIZE * sizeof *buffer);
+    long long in_bytes;   // Through comb2map for a mapper, map2red for a reducer.
+    long long out_bytes;  // Through map2red, for a mapper.
+    long long blocked_ns; // On full map2red pipes, for a mapper.
+} child_t;
+
+long long ns_between(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000000LL + (end->tv_nsec - start->tv_nsec);
+}
 
-    int index = 0;
+/**
+ * @brief With -t, wait for room in a full comb2map pipe, and add the time
+ * spent to feed_stats.
+ */
+void wait_writable(int fd)
+{
+    struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (poll(&pfd, 1, -1) == -1 && errno == EINTR)
+        ;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    feed_stats.blocked_ns += ns_between(&start, &end);
+}
 
-    int c;
-    while ((c = fgetc(stdin)) != EOF)
+/**
+ * @brief write() all of buf, retrying after partial writes.
+ * @return 0 on success, -1 on error.
+ */
+int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
     {
-        buffer[index++] = c;
-    };
+        ssize_t written = write(fd, buf, len);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+            {
+                wait_writable(fd);
+                continue;
+            }
+            return -1;
+        }
+
+        buf += written;
+        len -= written;
+    }
 
-    return buffer;
+    return 0;
 }
 
-void mapper_proc(int pipein[2], int pipeout[2])
+/**
+ * @brief read() input, retrying if interrupted.
+ */
+ssize_t read_input(int fd, char *buf, size_t len)
 {
-    // Close unused pipes for this process.
-    close(pipein[PIPE_W]);
-    close(pipeout[PIPE_R]);
+    ssize_t n;
+    while ((n = read(fd, buf, len)) == -1 && errno == EINTR)
+        ;
 
-    // Input from the text
-    if (dup2(pipein[PIPE_R], STDIN_FILENO) == -1)
+    if (n == -1)
     {
-        printf("[child] ERROR dup2(): Couldn't redirect mapper stdin.\n");
+        printf("ERROR: Couldn't read input.\n");
+        exit(EXIT_FAILURE);
+    }
+    return n;
+}
+
+void write_to_mapper(int fd, const char *buf, size_t len)
+{
+    if (write_all(fd, buf, len) == -1)
+    {
+        printf("ERROR: Couldn't write to comb2map pipe.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Move all of the input into a pipe with splice(), without copying it
+ * through user space.
+ * @return 0 on success, -1 if the input can't be spliced at all.
+ */
+int splice_input(int in_fd, int fd)
+{
+    int spliced_any = 0;
+
+    while (1)
+    {
+        ssize_t n = splice(in_fd, NULL, fd, NULL, FEED_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n == 0)
+            return 0;
+
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EINVAL && !spliced_any)
+                return -1;
+            if (errno == EAGAIN)
+            {
+                // With -t, the pipe is non-blocking, so either it is full or
+                // a piped stdin is empty.
+                struct pollfd pfds[2] = {{.fd = fd, .events = POLLOUT}, {.fd = in_fd, .events = POLLIN}};
+                if (poll(pfds, 1, 0) == 1)
+                    poll(&pfds[1], 1, -1);
+                else
+                    wait_writable(fd);
+                continue;
+            }
+            printf("ERROR: Couldn't splice input.\n");
+            exit(EXIT_FAILURE);
+        }
+
+        spliced_any = 1;
+        feed_stats.bytes[0] += n;
+    }
+}
+
+/**
+ * @brief Allocate a feed buffer. With -z, it is page-aligned so it can be
+ * given to a pipe with vmsplice().
+ */
+char *feed_buffer(void)
+{
+    if (!zero_copy)
+        return malloc(FEED_CHUNK_SIZE);
+
+    char *buf = mmap(NULL, FEED_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED)
+    {
+        printf("ERROR: Couldn't map feed buffer.\n");
+        exit(EXIT_FAILURE);
+    }
+    return buf;
+}
+
+/**
+ * @brief Send a feed buffer to a mapper. With -z, its pages are handed to
+ * the pipe, and *buf is replaced with a new buffer.
+ */
+void send_to_mapper(int fd, char **buf, size_t len)
+{
+    if (!zero_copy)
+    {
+        write_to_mapper(fd, *buf, len);
+        return;
+    }
+
+    struct iovec iov = {*buf, len};
+    while (iov.iov_len > 0)
+    {
+        // vmsplice() only honours O_NONBLOCK when it is asked to.
+        ssize_t n = vmsplice(fd, &iov, 1, SPLICE_F_GIFT | (telemetry ? SPLICE_F_NONBLOCK : 0));
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+            {
+                wait_writable(fd);
+                continue;
+            }
+            printf("ERROR: Couldn't vmsplice to comb2map pipe.\n");
+            exit(EXIT_FAILURE);
+        }
+        iov.iov_base = (char *)iov.iov_base + n;
+        iov.iov_len -= n;
+    }
+
+    // The pipe keeps its own references to the pages.
+    munmap(*buf, FEED_CHUNK_SIZE);
+    *buf = feed_buffer();
+}
+
+void free_feed_buffer(char *buf)
+{
+    if (zero_copy)
+        munmap(buf, FEED_CHUNK_SIZE);
+    else
+        free(buf);
+}
+
+/**
+ * @brief Sends blocks of input to the mappers.
+ *
+ * With one mapper the input is passed through untouched. With several, each
+ * "(id, action, topic)" tuple goes to mapper hash(id) % num_mappers, so all
+ * tuples for an ID are mapped by the same process, in input order.
+ */
+typedef struct feeder
+{
+    int *fds;
+    int num_mappers;
+
+    // One output buffer per mapper.
+    char *out[MAX_PROCS];
+    size_t out_len[MAX_PROCS];
+
+    // The start of a tuple that was cut off at the end of the last block.
+    char carry[FEED_CHUNK_SIZE];
+    size_t carry_len;
+} feeder_t;
+
+/**
+ * @brief Route the whole tuples in [p, end) to their mappers.
+ * @return The start of an incomplete tuple at the end, or end.
+ */
+const char *route_tuples(feeder_t *f, const char *p, const char *end)
+{
+    while (1)
+    {
+        const char *open = memchr(p, '(', end - p);
+        if (open == NULL)
+            return end; // Only separators left.
+
+        const char *close_paren = memchr(open, ')', end - open);
+        if (close_paren == NULL)
+            return open; // Incomplete tuple.
+
+        // The ID is the first field, minus surrounding spaces.
+        const char *id = open + 1;
+        while (id < close_paren && *id == ' ')
+            id++;
+        const char *id_end = id;
+        while (id_end < close_paren && *id_end != ',' && *id_end != ' ')
+            id_end++;
+
+        const int m = hash_id(id, id_end - id) % f->num_mappers;
+
+        // Send the tuple on its own line.
+        const size_t tuple_len = close_paren - open + 1;
+        if (f->out_len[m] + tuple_len + 1 > FEED_CHUNK_SIZE)
+        {
+            send_to_mapper(f->fds[m], &f->out[m], f->out_len[m]);
+            f->out_len[m] = 0;
+        }
+        memcpy(f->out[m] + f->out_len[m], open, tuple_len);
+        f->out_len[m] += tuple_len;
+        f->out[m][f->out_len[m]++] = '\n';
+        feed_stats.bytes[m] += tuple_len + 1;
+
+        p = close_paren + 1;
+    }
+}
+
+void feeder_init(feeder_t *f, int fds[], int num_mappers)
+{
+    f->fds = fds;
+    f->num_mappers = num_mappers;
+    f->carry_len = 0;
+
+    for (int i = 0; num_mappers > 1 && i < num_mappers; i++)
+    {
+        f->out[i] = feed_buffer();
+        f->out_len[i] = 0;
+    }
+}
+
+/**
+ * @brief Send a block of input to the mappers. Only the tuple cut off at
+ * the end of the block is copied; the rest is routed from the block itself.
+ */
+void feed_block(void *arg, const char *buf, size_t len)
+{
+    feeder_t *f = arg;
+
+    if (f->num_mappers == 1)
+    {
+        write_to_mapper(f->fds[0], buf, len);
+        feed_stats.bytes[0] += len;
+        return;
+    }
+
+    const char *p = buf, *end = buf + len;
+
+    if (f->carry_len > 0)
+    {
+        // Complete the tuple from the last block.
+        const char *close_paren = memchr(p, ')', end - p);
+        const size_t take = close_paren ? (size_t)(close_paren + 1 - p) : len;
+        if (f->carry_len + take > FEED_CHUNK_SIZE)
+        {
+            printf("ERROR: Input tuple longer than %d bytes.\n", FEED_CHUNK_SIZE);
+            exit(EXIT_FAILURE);
+        }
+
+        memcpy(f->carry + f->carry_len, p, take);
+        f->carry_len += take;
+        p += take;
+
+        if (close_paren == NULL)
+            return;
+
+        route_tuples(f, f->carry, f->carry + f->carry_len);
+        f->carry_len = 0;
+    }
+
+    const char *rest = route_tuples(f, p, end);
+    if (end - rest > FEED_CHUNK_SIZE)
+    {
+        printf("ERROR: Input tuple longer than %d bytes.\n", FEED_CHUNK_SIZE);
         exit(EXIT_FAILURE);
     }
+    memcpy(f->carry, rest, end - rest);
+    f->carry_len = end - rest;
+}
 
-    // Output to the pipe to the reducer.
-    if (dup2(pipeout[PIPE_W], STDOUT_FILENO) == -1)
+/**
+ * @brief Send whatever is still buffered for the mappers.
+ */
+void feeder_finish(feeder_t *f)
+{
+    for (int i = 0; f->num_mappers > 1 && i < f->num_mappers; i++)
     {
-        printf("[child] ERROR dup2(): Couldn't redirect mapper stdout.\n");
+        send_to_mapper(f->fds[i], &f->out[i], f->out_len[i]);
+        free_feed_buffer(f->out[i]);
+    }
+}
+
+/**
+ * @brief Stream the input into the mappers' pipes in large chunks. Runs in the
+ * combiner after all children have started, so no pipe ever has to hold the
+ * whole input.
+ */
+void feed_mappers(int in_fd, int fds[], int num_mappers)
+{
+    if (num_mappers == 1 && zero_copy && splice_input(in_fd, fds[0]) == 0)
+        return;
+
+    static feeder_t feeder;
+    feeder_init(&feeder, fds, num_mappers);
+
+    // With -i, read a regular file with io_uring. Anything else, or a
+    // kernel without io_uring, falls back to read().
+    if (!use_uring || uring_read_file(in_fd, feed_block, &feeder) == -1)
+    {
+        char *chunk = malloc(FEED_CHUNK_SIZE);
+        ssize_t len;
+
+        while ((len = read_input(in_fd, chunk, FEED_CHUNK_SIZE)) != 0)
+            feed_block(&feeder, chunk, len);
+
+        free(chunk);
+    }
+
+    feeder_finish(&feeder);
+}
+
+/**
+ * @brief In a child, move the given file descriptors to first_fd,
+ * first_fd + 1, ... and close every other descriptor from first_fd up.
+ */
+void install_fds(const int fds[], int num_fds, int first_fd)
+{
+    int copies[MAX_PROCS + 1];
+
+    // Copy them out of the way first, so the dup2()s below can't clobber a
+    // descriptor that is still needed.
+    for (int i = 0; i < num_fds; i++)
+        copies[i] = fcntl(fds[i], F_DUPFD, first_fd + num_fds);
+
+    for (int i = 0; i < num_fds; i++)
+    {
+        if (copies[i] == -1 || dup2(copies[i], first_fd + i) == -1)
+        {
+            printf("[child] ERROR dup2(): Couldn't redirect file descriptors.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    close_range(first_fd + num_fds, ~0U, 0);
+}
+
+void mapper_proc(int pipein[2], int map2red[][2], int num_reducers, int stats_fd)
+{
+    // Input from the text
+    if (dup2(pipein[PIPE_R], STDIN_FILENO) == -1)
+    {
+        printf("[child] ERROR dup2(): Couldn't redirect mapper stdin.\n");
         exit(EXIT_FAILURE);
     }
+
+    // Output to the pipes to the reducers, then with -t the telemetry pipe.
+    // Closes every other pipe, so the reducers see EOF once all mappers exit.
+    int outs[MAX_PROCS + 1];
+    int num_outs = 0;
+    for (int i = 0; i < num_reducers; i++)
+        outs[num_outs++] = map2red[i][PIPE_W];
+    if (telemetry)
+        outs[num_outs++] = stats_fd;
+
+    install_fds(outs, num_outs, MAPPER_OUT_FD);
+
 #if DEBUG
     printf("[child] running mapper...\n");
 #endif
+    char num_reducers_arg[16];
+    snprintf(num_reducers_arg, sizeof num_reducers_arg, "%d", num_reducers);
+
     // Run mapper
     // argv[0] is the process name (for ps)
-    execl(MAPPER_PATH, MAPPER_PATH, (char *)NULL);
+    char *args[] = {MAPPER_PATH, "-r", num_reducers_arg, NULL, NULL, NULL, NULL, NULL};
+    int num_args = 3;
+    if (binary)
+        args[num_args++] = "-b";
+    if (telemetry)
+        args[num_args++] = "-t";
+    if (zero_copy)
+        args[num_args++] = "-z";
+    if (daemon_socket != NULL)
+        args[num_args++] = "-j";
+    execv(MAPPER_PATH, args);
 
     printf("ERROR: Couldn't execute mapper.\n");
     exit(EXIT_FAILURE);
 }
 
-void reducer_proc(int pipein[2])
+void reducer_proc(int pipein[2], int num_mappers, int pipeout[2])
 {
-    // Close unused pipes for this process.
-    close(pipein[PIPE_W]);
-
-    // Input from the pipe from the mapper.
+    // Input from the pipe, or with -f the memfd, from the mappers.
     if (dup2(pipein[PIPE_R], STDIN_FILENO) == -1)
     {
         printf("[child] ERROR dup2(): Couldn't redirect reducer stdin.\n");
         exit(EXIT_FAILURE);
     }
+
+    // As a daemon, output goes back to the combiner.
+    if (pipeout != NULL && dup2(pipeout[PIPE_W], STDOUT_FILENO) == -1)
+    {
+        printf("[child] ERROR dup2(): Couldn't redirect reducer stdout.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Close every other pipe.
+    close_range(STDERR_FILENO + 1, ~0U, 0);
 #if DEBUG
     printf("[child] running reducer...\n");
 #endif
     // Run reducer
-    execl(REDUCER_PATH, REDUCER_PATH, (char *)NULL);
+    char *args[] = {REDUCER_PATH, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL};
+    int num_args = 1;
+    if (binary)
+        args[num_args++] = "-b";
+    if (handoff)
+        args[num_args++] = "-f";
+
+    if (sort_budget != NULL)
+    {
+        args[num_args++] = "-s";
+        args[num_args++] = (char *)sort_budget;
+    }
+
+    // Each mapper sends a reducer whole users, but a user too big for one
+    // atomic write can be interleaved with another mapper's output.
+    if (num_mappers > 1 || daemon_socket != NULL)
+        args[num_args++] = "-u";
+
+    // As a daemon, a job is done once every mapper has ended it.
+    char num_mappers_arg[16];
+    if (daemon_socket != NULL)
+    {
+        snprintf(num_mappers_arg, sizeof num_mappers_arg, "%d", num_mappers);
+        args[num_args++] = "-j";
+        args[num_args++] = num_mappers_arg;
+    }
+
+    execv(REDUCER_PATH, args);
 
     printf("ERROR: Couldn't execute reducer.\n");
     exit(EXIT_FAILURE);
 }
 
-int main(void)
+/**
+ * @brief Copy every reducer's output for the current job to the client, until
+ * each of them has ended the job with JOB_DELIM. Lines from different
+ * reducers are never mixed.
+ */
+void collect_results(int client_fd, const int red_fds[], int num_reducers)
 {
-    // Set up pipes for IPC
+    struct pollfd pfds[MAX_PROCS];
+    for (int i = 0; i < num_reducers; i++)
+        pfds[i] = (struct pollfd){.fd = red_fds[i], .events = POLLIN};
 
-    // First pipe, from this process to the mapper
-    int comb2map[2];
-    if (pipe(comb2map) == -1)
+    // Each reducer's output after its last complete line.
+    static char partial[MAX_PROCS][FEED_CHUNK_SIZE];
+    size_t partial_len[MAX_PROCS] = {0};
+
+    int client_ok = 1; // Keep draining the reducers if the client is gone.
+    int running = num_reducers;
+
+    while (running > 0)
     {
-        printf("ERROR: Couldn't make comb2map pipe.\n");
-        exit(EXIT_FAILURE);
+        if (poll(pfds, num_reducers, -1) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            printf("ERROR: Couldn't poll reducers.\n");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < num_reducers; i++)
+        {
+            if (pfds[i].fd < 0 || pfds[i].revents == 0)
+                continue;
+
+            char *buf = partial[i];
+            ssize_t n = read_input(pfds[i].fd, buf + partial_len[i], FEED_CHUNK_SIZE - partial_len[i]);
+            if (n == 0)
+            {
+                printf("ERROR: A reducer exited.\n");
+                exit(EXIT_FAILURE);
+            }
+
+            size_t len = partial_len[i] + n;
+            char *delim = memchr(buf + partial_len[i], JOB_DELIM, n);
+            if (delim != NULL)
+            {
+                // Nothing follows: the next job hasn't been sent yet.
+                len = delim - buf;
+                pfds[i].fd = -1;
+                running--;
+            }
+
+            // Send complete lines only, unless one doesn't fit the buffer.
+            size_t complete = len;
+            if (delim == NULL)
+            {
+                while (complete > 0 && buf[complete - 1] != '\n')
+                    complete--;
+                if (complete == 0 && len == FEED_CHUNK_SIZE)
+                    complete = len;
+            }
+
+            if (client_ok && write_all(client_fd, buf, complete) == -1)
+                client_ok = 0;
+
+            partial_len[i] = len - complete;
+            memmove(buf, buf + complete, partial_len[i]);
+        }
     }
+}
+
+/**
+ * @brief Serve jobs forever. Each connection to the socket is one job: its
+ * input is everything the client sends, and the results are sent back on the
+ * same connection, which is then closed.
+ */
+void run_daemon(int feed_fds[], int num_mappers, const int red_fds[], int num_reducers)
+{
+    // A client that goes away early must not take the daemon with it.
+    signal(SIGPIPE, SIG_IGN);
 
-    // Second pipe, from mapper to reducer
-    int map2red[2];
-    if (pipe(map2red) == -1)
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strncpy(addr.sun_path, daemon_socket, sizeof addr.sun_path - 1);
+    unlink(daemon_socket);
+
+    if (listen_fd == -1 ||
+        bind(listen_fd, (struct sockaddr *)&addr, sizeof addr) == -1 ||
+        listen(listen_fd, 16) == -1)
     {
-        printf("ERROR: Couldn't make map2red pipe.\n");
+        printf("ERROR: Couldn't listen on %s.\n", daemon_socket);
         exit(EXIT_FAILURE);
     }
 
-    // Read text input, and write it to the first pipe.
-    char *text = readTextFile();
+    while (1)
+    {
+        int client_fd = accept(listen_fd, NULL, NULL);
+        if (client_fd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            printf("ERROR: Couldn't accept a client.\n");
+            exit(EXIT_FAILURE);
+        }
 
-#if DEBUG
-    printf("[combiner] text: %s\n", text);
-#endif
+        feed_mappers(client_fd, feed_fds, num_mappers);
 
-    write(comb2map[PIPE_W], text, strlen(text) + 1);
+        const char delim = JOB_DELIM;
+        for (int i = 0; i < num_mappers; i++)
+            write_to_mapper(feed_fds[i], &delim, 1);
 
-#if DEBUG
-    printf("Starting mapper and reducer...\n");
-#endif
+        collect_results(client_fd, red_fds, num_reducers);
+        close(client_fd);
+    }
+}
 
-    // Send text as the stdin
-    pid_t mapper_pid, reducer_pid;
+/**
+ * @brief Send stdin to a daemon as one job, and print the results.
+ */
+int run_client(const char *socket_path)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strncpy(addr.sun_path, socket_path, sizeof addr.sun_path - 1);
 
-    switch ((mapper_pid = fork()))
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof addr) == -1)
     {
-    case -1:
-        printf("ERROR: Couldn't fork() properly.\n");
+        printf("ERROR: Couldn't connect to %s.\n", socket_path);
         exit(EXIT_FAILURE);
+    }
 
-    case 0: // Child process
-        mapper_proc(comb2map, map2red);
-        break;
+    char *chunk = malloc(FEED_CHUNK_SIZE);
+    ssize_t len;
 
-    default: // Parent process
-        // Close pipe for parent.
-        close(comb2map[PIPE_R]);
-        close(comb2map[PIPE_W]);
+    while ((len = read_input(STDIN_FILENO, chunk, FEED_CHUNK_SIZE)) != 0)
+    {
+        if (write_all(fd, chunk, len) == -1)
+        {
+            printf("ERROR: Couldn't send the job.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    shutdown(fd, SHUT_WR);
 
-        switch ((reducer_pid = fork()))
+    while ((len = read_input(fd, chunk, FEED_CHUNK_SIZE)) != 0)
+    {
+        if (write_all(STDOUT_FILENO, chunk, len) == -1)
+            exit(EXIT_FAILURE);
+    }
+
+    free(chunk);
+    close(fd);
+    return 0;
+}
+
+/**
+ * @brief Fork every reducer, reading from its map2red pipe or memfd.
+ */
+void start_reducers(child_t reducers[], int num_reducers, int map2red[][2], int num_mappers, int red2comb[][2])
+{
+    for (int i = 0; i < num_reducers; i++)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &reducers[i].started);
+        switch ((reducers[i].pid = fork()))
         {
         case -1:
             printf("ERROR: Couldn't fork() properly.\n");
             exit(EXIT_FAILURE);
 
-        case 0:
-            reducer_proc(map2red);
+        case 0: // Child process
+            reducer_proc(map2red[i], num_mappers, daemon_socket ? red2comb[i] : NULL);
             break;
+        }
+    }
+}
+
+/**
+ * @brief With -t, read the mappers' reports (see write_telemetry() in
+ * mapper.c) until every mapper has exited, and add them to the children.
+ */
+void read_telemetry(int fd, child_t mappers[], int num_mappers, child_t reducers[], int num_reducers)
+{
+    size_t size = FEED_CHUNK_SIZE, len = 0;
+    char *buf = malloc(size);
 
+    ssize_t n;
+    while ((n = read_input(fd, buf + len, size - len - 1)) != 0)
+    {
+        len += n;
+        if (len + 1 == size)
+            buf = realloc(buf, size *= 2);
+    }
+    buf[len] = '\0';
+
+    for (char *line = buf; *line != '\0';)
+    {
+        char *p;
+        const pid_t pid = strtol(line, &p, 10);
+        const long long blocked_ns = strtoll(p, &p, 10);
+
+        child_t *mapper = NULL;
+        for (int i = 0; i < num_mappers; i++)
+        {
+            if (mappers[i].pid == pid)
+                mapper = &mappers[i];
+        }
+
+        for (int i = 0; i < num_reducers; i++)
+        {
+            const long long bytes = strtoll(p, &p, 10);
+            reducers[i].in_bytes += bytes;
+            if (mapper != NULL)
+                mapper->out_bytes += bytes;
+        }
+
+        if (mapper != NULL)
+            mapper->blocked_ns = blocked_ns;
+
+        char *end = strchr(line, '\n');
+        line = end ? end + 1 : line + strlen(line);
+    }
+
+    free(buf);
+}
+
+/**
+ * @brief Wait for every child to exit, in whatever order they do, and record
+ * how each one exited and what it used.
+ * @return 0 if all of them exited successfully, -1 otherwise.
+ */
+int reap_children(child_t children[], int num_children)
+{
+    int result = 0;
+
+    for (int reaped = 0; reaped < num_children;)
+    {
+        int status;
+        struct rusage usage;
+        const pid_t pid = wait4(-1, &status, 0, &usage);
+        if (pid == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            printf("ERROR: Couldn't wait for children.\n");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < num_children; i++)
+        {
+            if (children[i].pid != pid)
+                continue;
+
+            clock_gettime(CLOCK_MONOTONIC, &children[i].ended);
+            children[i].status = status;
+            children[i].usage = usage;
+            reaped++;
+
+            if (WIFSIGNALED(status))
+            {
+                printf("ERROR: Child %d was killed by signal %d.\n", pid, WTERMSIG(status));
+                result = -1;
+            }
+            else if (WEXITSTATUS(status) != 0)
+            {
+                printf("ERROR: Child %d exited with status %d.\n", pid, WEXITSTATUS(status));
+                result = -1;
+            }
+        }
+    }
+
+    return result;
+}
+
+/**
+ * @brief Print one child as a JSON object.
+ */
+void print_child(FILE *out, const child_t *c, int is_mapper)
+{
+    const int status = WIFSIGNALED(c->status) ? 128 + WTERMSIG(c->status) : WEXITSTATUS(c->status);
+    const struct timeval *ut = &c->usage.ru_utime, *st = &c->usage.ru_stime;
+
+    fprintf(out, "{\"pid\": %d, \"exit_status\": %d, \"wall_ms\": %.3f, "
+                 "\"user_ms\": %.3f, \"sys_ms\": %.3f, \"maxrss_kb\": %ld, "
+                 "\"in_bytes\": %lld",
+            c->pid, status, ns_between(&c->started, &c->ended) / 1e6,
+            ut->tv_sec * 1e3 + ut->tv_usec / 1e3, st->tv_sec * 1e3 + st->tv_usec / 1e3,
+            c->usage.ru_maxrss, c->in_bytes);
+
+    if (is_mapper)
+        fprintf(out, ", \"out_bytes\": %lld, \"blocked_ms\": %.3f", c->out_bytes, c->blocked_ns / 1e6);
+
+    fprintf(out, "}");
+}
+
+/**
+ * @brief With -t, report every stage on stderr as one JSON object:
+ *
+ *   {"feeder": {...}, "mappers": [{...}, ...], "reducers": [{...}, ...]}
+ *
+ * Bytes are counted through comb2map (feeder out, mapper in) and map2red
+ * (mapper out, reducer in). Times are wall time from fork() to exit, CPU time
+ * from wait4(), and time blocked writing to a full pipe, which only the
+ * feeder and the mappers measure: they are the only writers to those pipes.
+ */
+void print_telemetry(const struct timespec feed_times[2], const child_t mappers[], int num_mappers,
+                     const child_t reducers[], int num_reducers)
+{
+    long long fed = 0;
+    for (int i = 0; i < num_mappers; i++)
+        fed += feed_stats.bytes[i];
+
+    fprintf(stderr, "{\"feeder\": {\"wall_ms\": %.3f, \"out_bytes\": %lld, \"blocked_ms\": %.3f},\n",
+            ns_between(&feed_times[0], &feed_times[1]) / 1e6, fed, feed_stats.blocked_ns / 1e6);
+
+    fprintf(stderr, " \"mappers\": [");
+    for (int i = 0; i < num_mappers; i++)
+    {
+        fprintf(stderr, i == 0 ? "\n  " : ",\n  ");
+        print_child(stderr, &mappers[i], 1);
+    }
+
+    fprintf(stderr, "],\n \"reducers\": [");
+    for (int i = 0; i < num_reducers; i++)
+    {
+        fprintf(stderr, i == 0 ? "\n  " : ",\n  ");
+        print_child(stderr, &reducers[i], 0);
+    }
+    fprintf(stderr, "]}\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int num_mappers = 1, num_reducers = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "bc:d:fim:r:s:tz")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            binary = 1;
+            break;
+        case 'c':
+            return run_client(optarg);
+        case 'd':
+            daemon_socket = optarg;
+            break;
+        case 'f':
+            handoff = 1;
+            break;
+        case 'i':
+            use_uring = 1;
+            break;
+        case 'm':
+            num_mappers = atoi(optarg);
+            break;
+        case 'r':
+            num_reducers = atoi(optarg);
+            break;
+        case 's':
+            sort_budget = optarg;
+            break;
+        case 't':
+            telemetry = 1;
+            break;
+        case 'z':
+            zero_copy = 1;
+            break;
         default:
-            // Close pipes for parent.
-            close(map2red[PIPE_R]);
-            close(map2red[PIPE_W]);
+            printf("Usage: combiner [-b] [-f] [-i] [-m <no. mappers>] [-r <no. reducers>] [-s <MiB>] [-t] [-z] [-d <socket>]\n"
+                   "       combiner -c <socket>\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (num_mappers < 1 || num_mappers > MAX_PROCS ||
+        num_reducers < 1 || num_reducers > MAX_PROCS)
+    {
+        printf("ERROR: -m and -r must be between 1 and %d.\n", MAX_PROCS);
+        exit(EXIT_FAILURE);
+    }
+
+    if (daemon_socket != NULL && sort_budget != NULL)
+    {
+        printf("ERROR: -d and -s can't be used together.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (daemon_socket != NULL && telemetry)
+    {
+        printf("ERROR: -d and -t can't be used together.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (daemon_socket != NULL && handoff)
+    {
+        printf("ERROR: -d and -f can't be used together.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Set up pipes for IPC
+
+    // First set of pipes, from this process to each mapper
+    int comb2map[MAX_PROCS][2];
+    for (int i = 0; i < num_mappers; i++)
+    {
+        if (pipe(comb2map[i]) == -1)
+        {
+            printf("ERROR: Couldn't make comb2map pipe.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Second set of pipes, from the mappers to each reducer. With -f, a
+    // memfd per reducer instead, which is both the read and the write end.
+    int map2red[MAX_PROCS][2];
+    for (int i = 0; i < num_reducers; i++)
+    {
+        if (handoff)
+        {
+            char name[32];
+            snprintf(name, sizeof name, "map2red-%d", i);
+            map2red[i][PIPE_R] = map2red[i][PIPE_W] = memfd_create(name, MFD_CLOEXEC);
+
+            // Mappers share the file. Appends are atomic, but writes at the
+            // shared offset of a memfd are not.
+            if (map2red[i][PIPE_R] == -1 || fcntl(map2red[i][PIPE_R], F_SETFL, O_APPEND) == -1)
+            {
+                printf("ERROR: Couldn't make map2red memfd.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (pipe(map2red[i]) == -1)
+        {
+            printf("ERROR: Couldn't make map2red pipe.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // As a daemon, third set of pipes, from each reducer back to this process
+    int red2comb[MAX_PROCS][2];
+    for (int i = 0; daemon_socket != NULL && i < num_reducers; i++)
+    {
+        if (pipe(red2comb[i]) == -1)
+        {
+            printf("ERROR: Couldn't make red2comb pipe.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // With -t, a pipe for the mappers' reports
+    int stats[2] = {-1, -1};
+    if (telemetry && pipe(stats) == -1)
+    {
+        printf("ERROR: Couldn't make telemetry pipe.\n");
+        exit(EXIT_FAILURE);
+    }
 
-            // Wait for both processes to finish.
-            wait(&mapper_pid);
-            wait(&reducer_pid);
 #if DEBUG
-            printf("[combiner] Mapper and reducer finished.\n");
+    printf("Starting %d mappers and %d reducers...\n", num_mappers, num_reducers);
 #endif
+
+    // Start all children first, then send the text as the mappers' stdin.
+    static child_t children[2 * MAX_PROCS];
+    child_t *mappers = children, *reducers = children + num_mappers;
+
+    for (int i = 0; i < num_mappers; i++)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &mappers[i].started);
+        switch ((mappers[i].pid = fork()))
+        {
+        case -1:
+            printf("ERROR: Couldn't fork() properly.\n");
+            exit(EXIT_FAILURE);
+
+        case 0: // Child process
+            mapper_proc(comb2map[i], map2red, num_reducers, stats[PIPE_W]);
+            break;
+        }
+    }
+
+    // With -f, the reducers only start once the mappers are done.
+    if (!handoff)
+        start_reducers(reducers, num_reducers, map2red, num_mappers, red2comb);
+
+    // Close pipes for parent. Keep the write ends to feed the mappers.
+    int feed_fds[MAX_PROCS];
+    for (int i = 0; i < num_mappers; i++)
+    {
+        close(comb2map[i][PIPE_R]);
+        feed_fds[i] = comb2map[i][PIPE_W];
+
+        // With -t, so that time blocked on a full pipe can be measured.
+        if (telemetry)
+            fcntl(feed_fds[i], F_SETFL, fcntl(feed_fds[i], F_GETFL) | O_NONBLOCK);
+    }
+
+    if (telemetry)
+        close(stats[PIPE_W]);
+
+    for (int i = 0; !handoff && i < num_reducers; i++)
+    {
+        close(map2red[i][PIPE_R]);
+        close(map2red[i][PIPE_W]);
+    }
+
+    if (daemon_socket != NULL)
+    {
+        int red_fds[MAX_PROCS];
+        for (int i = 0; i < num_reducers; i++)
+        {
+            close(red2comb[i][PIPE_W]);
+            red_fds[i] = red2comb[i][PIPE_R];
         }
+
+        run_daemon(feed_fds, num_mappers, red_fds, num_reducers);
     }
+
+    // All stages are running now. Stream the input to the mappers while
+    // they work, then close the pipes so the mappers see EOF.
+    struct timespec feed_times[2];
+    clock_gettime(CLOCK_MONOTONIC, &feed_times[0]);
+    feed_mappers(STDIN_FILENO, feed_fds, num_mappers);
+    clock_gettime(CLOCK_MONOTONIC, &feed_times[1]);
+
+    for (int i = 0; i < num_mappers; i++)
+    {
+        close(feed_fds[i]);
+        mappers[i].in_bytes = feed_stats.bytes[i];
+    }
+
+    // The mappers report as they exit, so this ends once they all have.
+    if (telemetry)
+    {
+        read_telemetry(stats[PIPE_R], mappers, num_mappers, reducers, num_reducers);
+        close(stats[PIPE_R]);
+    }
+
+    // Wait for all processes to finish.
+    int result;
+    if (handoff)
+    {
+        // Hand each reducer its memfd, from the start, once every mapper has
+        // finished writing to it.
+        result = reap_children(mappers, num_mappers);
+        if (result == -1)
+            exit(EXIT_FAILURE);
+
+        for (int i = 0; i < num_reducers; i++)
+            lseek(map2red[i][PIPE_R], 0, SEEK_SET);
+
+        start_reducers(reducers, num_reducers, map2red, num_mappers, red2comb);
+
+        for (int i = 0; i < num_reducers; i++)
+            close(map2red[i][PIPE_R]);
+
+        result = reap_children(reducers, num_reducers);
+    }
+    else
+        result = reap_children(children, num_mappers + num_reducers);
+
+    if (telemetry)
+        print_telemetry(feed_times, mappers, num_mappers, reducers, num_reducers);
+
+#if DEBUG
+    printf("[combiner] Mappers and reducers finished.\n");
+#endif
+
 #if DEBUG
     printf("[combiner] Done.\n");
 #endif
-    return 0;
+    return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -1,125 +1,806 @@
+#define _GNU_SOURCE // for vmsplice()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h> // for PIPE_BUF
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "partition.h"
+#include "record_frame.h"
 
 #define DEBUG 0
 
+// Upper bound for -r.
+#define MAX_REDUCERS 64
+
+// With -r, output for reducer j goes to file descriptor FIRST_OUT_FD + j.
+#define FIRST_OUT_FD 3
+
+// Size of the input buffer. It grows if a tuple doesn't fit.
+#define READ_BUF_SIZE (64 * 1024)
+
+// Size of the output buffer when the mapper is the only writer to stdout.
+#define OUT_BUF_SIZE (64 * 1024)
+
+// With -z, output pages are mapped this many at a time.
+#define PAGES_PER_CHUNK 64
+
+// Slots in the hash table over a frame's strings. A power of two, and more
+// than twice FRAME_MAX_STRINGS, so probes stay short even in a full frame.
+#define FRAME_HASH_SLOTS 4096
+
+// With -z, output to pipes is handed to the kernel with vmsplice() instead of
+// being copied by write().
+bool zero_copy = false;
+size_t page_size;
+
+// With -b, output is in binary frames (see record_frame.h).
+bool binary = false;
+
+// With -j, input is a series of jobs, each ended by JOB_DELIM. Each job is
+// mapped on its own, and its output is followed by an end-of-job marker.
+bool jobs = false;
+
+// With -t, the mapper measures its output for the combiner. The output pipes
+// are made non-blocking, so the time spent waiting for room in them can be
+// added up, and a report is written to file descriptor FIRST_OUT_FD + <no.
+// reducers> at exit (see write_telemetry()).
+bool telemetry = false;
+long long blocked_ns = 0;
+
 /**
- * @brief Read stdin into a buffer.
- * WARNING: You must free() the returned char*!
+ * @brief Buffered output to one reducer.
+ *
+ * Several mappers may share a reducer's pipe, and a write() of at most
+ * PIPE_BUF bytes to a pipe is never interleaved with other writers. So each
+ * write() carries whole lines and, whenever possible, only whole users: the
+ * reducer then still sees each user's lines together.
+ *
+ * With -b, the same holds for frames (see record_frame.h): each write() is one
+ * frame, and a frame ends at a user boundary unless one user fills it alone.
+ *
+ * With -z, data is the start of a page. Instead of being written, it is given
+ * to the pipe with vmsplice(), which fills one pipe buffer and so is just as
+ * atomic, and output continues on the next page.
+ *
+ * Without -r, stdout has no other writers, and the buffer is OUT_BUF_SIZE.
+ * It is that big for a regular file too, shared or not.
  */
-char *read(void)
+typedef struct out_buf
+{
+    int fd;
+    char *data;
+    size_t size; // PIPE_BUF, unless the output isn't shared.
+    size_t len;
+    size_t committed; // data[0, committed) holds only complete users.
+    long long written; // Bytes sent to the reducer so far.
+
+    // With -z and a pipe, the pages data comes from. Pages before data
+    // belong to the pipe now.
+    bool spliced;
+    char *chunk;
+    size_t chunk_page;
+
+    // The frame being built with -b. Strings and records are kept apart
+    // and laid out behind the header when the frame is written.
+    char strings[FRAME_MAX];
+    size_t strings_len;
+    uint16_t string_offs[FRAME_MAX_STRINGS];
+    uint32_t num_strings;
+    frame_record_t records[FRAME_MAX_RECORDS];
+    uint32_t num_records;
+
+    // Open-addressed hash table over the frame's strings: the index of a
+    // string plus one, or 0 for a free slot. string_slots[i] is the slot of
+    // string i, so the table can be cleared without a full memset.
+    uint16_t string_hash[FRAME_HASH_SLOTS];
+    uint16_t string_slots[FRAME_MAX_STRINGS];
+
+    // The frame up to the last complete user.
+    size_t committed_strings_len;
+    uint32_t committed_strings;
+    uint32_t committed_records;
+} out_buf_t;
+
+/**
+ * @brief With -t, wait for room in a full output pipe, and add the time spent
+ * to blocked_ns.
+ */
+void wait_writable(int fd)
+{
+    struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (poll(&pfd, 1, -1) == -1 && errno == EINTR)
+        ;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    blocked_ns += (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+}
+
+void write_out(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t written = write(fd, buf, len);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+            {
+                wait_writable(fd);
+                continue;
+            }
+            fprintf(stderr, "ERROR: Couldn't write mapper output.\n");
+            exit(EXIT_FAILURE);
+        }
+        buf += written;
+        len -= written;
+    }
+}
+
+/**
+ * @brief vmsplice() a buffer into a pipe, giving its pages to the kernel. The
+ * caller must not change the buffer afterwards.
+ */
+void splice_out(int fd, char *buf, size_t len)
+{
+    struct iovec iov = {buf, len};
+
+    while (iov.iov_len > 0)
+    {
+        // vmsplice() only honours O_NONBLOCK when it is asked to.
+        ssize_t spliced = vmsplice(fd, &iov, 1, SPLICE_F_GIFT | (telemetry ? SPLICE_F_NONBLOCK : 0));
+        if (spliced == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+            {
+                wait_writable(fd);
+                continue;
+            }
+            fprintf(stderr, "ERROR: Couldn't vmsplice mapper output.\n");
+            exit(EXIT_FAILURE);
+        }
+        iov.iov_base = (char *)iov.iov_base + spliced;
+        iov.iov_len -= spliced;
+    }
+}
+
+char *map_chunk(void)
+{
+    char *chunk = mmap(NULL, PAGES_PER_CHUNK * page_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (chunk == MAP_FAILED)
+    {
+        fprintf(stderr, "ERROR: Couldn't map output pages.\n");
+        exit(EXIT_FAILURE);
+    }
+    return chunk;
+}
+
+void out_init(out_buf_t *out, int fd, bool shared)
+{
+    out->fd = fd;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        st.st_mode = 0;
+
+    out->spliced = zero_copy && page_size >= PIPE_BUF && S_ISFIFO(st.st_mode);
+
+    // Appends to a shared regular file (the combiner's memfd with -f) are
+    // atomic whatever their size.
+    out->size = (shared && !S_ISREG(st.st_mode)) || out->spliced ? PIPE_BUF : OUT_BUF_SIZE;
+    out->written = 0;
+    if (out->spliced)
+        out->data = out->chunk = map_chunk();
+    else
+        out->data = malloc(out->size);
+}
+
+void out_write(out_buf_t *out, size_t len)
+{
+    if (!out->spliced)
+    {
+        write_out(out->fd, out->data, len);
+
+        // Keep whatever wasn't written at the front of the buffer.
+        memmove(out->data, out->data + len, out->len - len);
+    }
+    else if (len > 0)
+    {
+        // Move on to the next page, keeping whatever isn't written.
+        char *page = out->data;
+        char *old_chunk = NULL;
+        if (++out->chunk_page == PAGES_PER_CHUNK)
+        {
+            old_chunk = out->chunk;
+            out->chunk = map_chunk();
+            out->chunk_page = 0;
+        }
+        out->data = out->chunk + out->chunk_page * page_size;
+        memcpy(out->data, page + len, out->len - len);
+
+        splice_out(out->fd, page, len);
+
+        // The pipe holds its own references to the pages.
+        if (old_chunk != NULL)
+            munmap(old_chunk, PAGES_PER_CHUNK * page_size);
+    }
+
+    out->written += len;
+    out->len -= len;
+    out->committed = 0;
+}
+
+void out_append(out_buf_t *out, const char *line, size_t len)
+{
+    if (out->len + len > out->size)
+    {
+        // Write the complete users, keeping the current one together.
+        out_write(out, out->committed ? out->committed : out->len);
+
+        // The current user alone is too big for one atomic write.
+        if (out->len + len > out->size)
+            out_write(out, out->len);
+    }
+
+    memcpy(out->data + out->len, line, len);
+    out->len += len;
+}
+
+size_t frame_size(const out_buf_t *out)
 {
-    const int BUF_SIZE = 1500;
+    return sizeof(frame_header_t) + out->strings_len +
+           out->num_records * sizeof(frame_record_t);
+}
 
-    char *buffer = malloc(BUF_SIZE * sizeof *buffer);
-    int index = 0;
+/**
+ * @brief The slot of a string in the current frame's hash table, or if the
+ * frame doesn't have it, the free slot it would go in.
+ */
+size_t frame_slot(const out_buf_t *out, const char *str, size_t len)
+{
+    size_t slot = hash_id(str, len) & (FRAME_HASH_SLOTS - 1);
 
-    int c;
-    while ((c = fgetc(stdin)) != EOF)
+    while (out->string_hash[slot] != 0)
     {
-        buffer[index++] = c;
+        const char *s = out->strings + out->string_offs[out->string_hash[slot] - 1];
+        uint16_t s_len;
+        memcpy(&s_len, s, sizeof s_len);
+        if (s_len == len && memcmp(s + sizeof s_len, str, len) == 0)
+            break;
+
+        slot = (slot + 1) & (FRAME_HASH_SLOTS - 1);
+    }
+
+    return slot;
+}
+
+/**
+ * @brief Index of a string in the current frame, adding it if needed. The
+ * caller makes sure it fits.
+ */
+uint32_t frame_string(out_buf_t *out, const char *str, size_t len)
+{
+    const size_t slot = frame_slot(out, str, len);
+    if (out->string_hash[slot] != 0)
+        return out->string_hash[slot] - 1;
+
+    char *s = out->strings + out->strings_len;
+    uint16_t s_len = len;
+    memcpy(s, &s_len, sizeof s_len);
+    memcpy(s + sizeof s_len, str, len);
+    s[sizeof s_len + len] = '\0';
+
+    out->string_offs[out->num_strings] = out->strings_len;
+    out->string_hash[slot] = out->num_strings + 1;
+    out->string_slots[out->num_strings] = slot;
+    out->strings_len += sizeof s_len + len + 1;
+    return out->num_strings++;
+}
+
+/**
+ * @brief Empty the current frame.
+ */
+void frame_reset(out_buf_t *out)
+{
+    for (uint32_t i = 0; i < out->num_strings; i++)
+        out->string_hash[out->string_slots[i]] = 0;
+
+    out->num_records = out->num_strings = out->strings_len = 0;
+    out->committed_records = out->committed_strings = 0;
+    out->committed_strings_len = 0;
+}
+
+/**
+ * @brief Add the first num_records records of the current frame, with its
+ * first num_strings strings, to the output buffer. Only whole frames are
+ * written, so each write() is still one or more complete frames.
+ */
+void frame_write(out_buf_t *out, uint32_t num_records, uint32_t num_strings,
+                 size_t strings_len)
+{
+    if (num_records == 0)
+        return;
+
+    frame_header_t header = {
+        .frame_len = sizeof header + strings_len +
+                     num_records * sizeof(frame_record_t),
+        .num_strings = num_strings,
+        .num_records = num_records,
     };
 
-    return buffer;
+    if (out->len + header.frame_len > out->size)
+        out_write(out, out->len);
+
+    // In binary mode, the text buffer holds whole frames.
+    char *frame = out->data + out->len;
+    memcpy(frame, &header, sizeof header);
+    memcpy(frame + sizeof header, out->strings, strings_len);
+    memcpy(frame + sizeof header + strings_len, out->records,
+           num_records * sizeof(frame_record_t));
+    out->len += header.frame_len;
 }
 
-typedef struct entry
+/**
+ * @brief Write out the complete users of the current frame, and start a new
+ * frame with the current user's records.
+ */
+void frame_flush(out_buf_t *out)
 {
-    char *id;
-    char *action;
-    char *topic;
-} entry_t;
+    if (out->committed_records == 0)
+    {
+        // One user filled the whole frame.
+        frame_write(out, out->num_records, out->num_strings, out->strings_len);
+        frame_reset(out);
+        return;
+    }
+
+    frame_write(out, out->committed_records, out->committed_strings,
+                out->committed_strings_len);
+
+    // The current user's records start the new frame, with only the strings
+    // they use. Strings keep their order, so each one moves to the front of
+    // where it was, over strings that are dropped or already moved.
+    frame_record_t *carried = out->records + out->committed_records;
+    const uint32_t num_carried = out->num_records - out->committed_records;
+    const uint32_t old_num_strings = out->num_strings;
+
+    // For each old string, its new index plus one, or 0 if it is dropped.
+    uint16_t new_index[FRAME_MAX_STRINGS] = {0};
+    for (uint32_t i = 0; i < num_carried; i++)
+        new_index[carried[i].id] = new_index[carried[i].topic] = 1;
 
-int main(void)
+    frame_reset(out);
+
+    for (uint32_t i = 0; i < old_num_strings; i++)
+    {
+        if (new_index[i] == 0)
+            continue;
+
+        const char *s = out->strings + out->string_offs[i];
+        uint16_t s_len;
+        memcpy(&s_len, s, sizeof s_len);
+
+        char *to = out->strings + out->strings_len;
+        memmove(to, s, sizeof s_len + s_len + 1);
+
+        const size_t slot = frame_slot(out, to + sizeof s_len, s_len);
+        out->string_offs[out->num_strings] = out->strings_len;
+        out->string_hash[slot] = out->num_strings + 1;
+        out->string_slots[out->num_strings] = slot;
+        out->strings_len += sizeof s_len + s_len + 1;
+        new_index[i] = ++out->num_strings;
+    }
+
+    for (uint32_t i = 0; i < num_carried; i++)
+    {
+        frame_record_t record = carried[i];
+        record.id = new_index[record.id] - 1;
+        record.topic = new_index[record.topic] - 1;
+        out->records[out->num_records++] = record;
+    }
+}
+
+void frame_append(out_buf_t *out, const char *id, const char *topic, int score)
 {
+    const size_t id_len = strlen(id), topic_len = strlen(topic);
 
-    char *text = read();
+    // Room for the record, and for both strings in case they are new.
+    const size_t needed = sizeof(frame_record_t) +
+                          2 * FRAME_MIN_STRING + id_len + topic_len;
 
-#if DEBUG
-    printf("text: \"%s\"\n\n", text);
-#endif
+    if (needed + sizeof(frame_header_t) > FRAME_MAX)
+    {
+        fprintf(stderr, "ERROR: Tuple too long for a frame.\n");
+        exit(EXIT_FAILURE);
+    }
 
-    // List of entries
-    entry_t entries[100];
-    unsigned entries_size = 0;
+    if (frame_size(out) + needed > FRAME_MAX)
+    {
+        frame_flush(out);
 
-    // Parse the text to obtain tokens.
-    const char delims[] = "(), \n";
+        // The current user alone is too big for one frame.
+        if (frame_size(out) + needed > FRAME_MAX)
+            frame_flush(out);
+    }
 
-#if DEBUG
-    printf("Tokens: ");
-#endif
+    // Records after the last commit are all the current user's, so an ID
+    // already in the frame is usually the last record's.
+    frame_record_t record = {
+        .id = out->num_records > out->committed_records
+                  ? out->records[out->num_records - 1].id
+                  : frame_string(out, id, id_len),
+        .topic = frame_string(out, topic, topic_len),
+        .score = score,
+    };
+    out->records[out->num_records++] = record;
+}
+
+/**
+ * @brief Mark everything buffered so far as complete users.
+ */
+void out_commit(out_buf_t *out)
+{
+    out->committed = out->len;
+    out->committed_records = out->num_records;
+    out->committed_strings = out->num_strings;
+    out->committed_strings_len = out->strings_len;
+}
 
-    char *token = strtok(text, delims); // TODO where are these tokens stored? Heap?
-    int token_i = 0;
+/**
+ * @brief Write out everything buffered.
+ */
+void out_flush(out_buf_t *out)
+{
+    frame_write(out, out->num_records, out->num_strings, out->strings_len);
+    out_write(out, out->len);
+    frame_reset(out);
+}
 
-    while (token != NULL)
+/**
+ * @brief Mark the end of a job in the output: JOB_DELIM, or with -b, a frame
+ * without records.
+ */
+void out_end_job(out_buf_t *out)
+{
+    out_flush(out);
+
+    if (binary)
     {
-#if DEBUG
-        printf("\"%s\", ", token);
-#endif
-        char *id;
-        char *action;
-        char *topic;
+        frame_header_t header = {sizeof header, 0, 0};
+        memcpy(out->data, &header, sizeof header);
+        out->len = sizeof header;
+    }
+    else
+    {
+        out->data[0] = JOB_DELIM;
+        out->len = 1;
+    }
 
-        if (token_i == 0)
+    out_write(out, out->len);
+}
+
+/**
+ * @brief Input, read in large blocks. Tuples are parsed in place, and are
+ * only valid until the next call to next_tuple().
+ */
+typedef struct input
+{
+    char *buf;
+    size_t size;
+    size_t start; // buf[start, end) has been read but not parsed yet.
+    size_t end;
+    bool eof;
+} input_t;
+
+/**
+ * @brief Read more input, keeping the unparsed bytes. Makes the buffer bigger
+ * if they fill it.
+ * @return false at the end of the input.
+ */
+bool input_fill(input_t *in)
+{
+    if (in->eof)
+        return false;
+
+    memmove(in->buf, in->buf + in->start, in->end - in->start);
+    in->end -= in->start;
+    in->start = 0;
+
+    if (in->end == in->size)
+    {
+        in->size *= 2;
+        in->buf = realloc(in->buf, in->size);
+    }
+
+    ssize_t n;
+    while ((n = read(STDIN_FILENO, in->buf + in->end, in->size - in->end)) == -1 && errno == EINTR)
+        ;
+
+    if (n == -1)
+    {
+        fprintf(stderr, "ERROR: Couldn't read mapper input.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (n == 0)
+    {
+        in->eof = true;
+        return false;
+    }
+
+    in->end += n;
+    return true;
+}
+
+// Skip spaces and newlines around a tuple field and terminate it in place.
+char *trim_field(char *begin, char *end)
+{
+    while (begin < end && (*begin == ' ' || *begin == '\n'))
+        begin++;
+    while (end > begin && (end[-1] == ' ' || end[-1] == '\n'))
+        end--;
+    *end = '\0';
+    return begin;
+}
+
+enum
+{
+    INPUT_END,
+    INPUT_JOB_END,
+    INPUT_TUPLE,
+};
+
+/**
+ * @brief Parse the next "(id, action, topic)" tuple.
+ * @return INPUT_TUPLE, or INPUT_END at the end of the input, or with -j,
+ * INPUT_JOB_END at the end of a job.
+ */
+int next_tuple(input_t *in, char **id, char **action, char **topic)
+{
+    while (1)
+    {
+        char *p = in->buf + in->start;
+        char *end = in->buf + in->end;
+
+        char *open = memchr(p, '(', end - p);
+        char *close_paren = open ? memchr(open, ')', end - open) : NULL;
+
+        if (jobs)
         {
-            // This is the first of the three tuple entries, which is the ID.
-            id = token;
-            token_i++;
+            // A job may end inside a tuple that was cut short. What there
+            // is of the tuple is dropped with the rest of the job.
+            char *delim = memchr(p, JOB_DELIM, (close_paren ? close_paren : end) - p);
+            if (delim != NULL)
+            {
+                in->start = delim + 1 - in->buf;
+                return INPUT_JOB_END;
+            }
         }
-        else if (token_i == 1)
+
+        if (close_paren == NULL)
         {
-            // This is the second tuple entry, which is the category.
-            action = token;
-            token_i++;
+            // Only separators, or the start of a tuple, are left.
+            in->start = open ? (size_t)(open - in->buf) : in->end;
+            if (!input_fill(in))
+                return INPUT_END;
+            continue;
         }
-        else
+
+        in->start = close_paren + 1 - in->buf;
+
+        char *comma1 = memchr(open, ',', close_paren - open);
+        char *comma2 = comma1 ? memchr(comma1 + 1, ',', close_paren - comma1 - 1) : NULL;
+        if (comma2 == NULL)
+            continue; // Not a tuple.
+
+        *id = trim_field(open + 1, comma1);
+        *action = trim_field(comma1 + 1, comma2);
+        *topic = trim_field(comma2 + 1, close_paren);
+        return INPUT_TUPLE;
+    }
+}
+
+/**
+ * @brief Get the score for a user action.
+ * @return false for an unknown action.
+ */
+bool action_score(const char *action, int *score)
+{
+    // Get cooresponding score from user action
+    if (strcmp(action, "P") == 0) // Post
+        *score = 50;
+    else if (strcmp(action, "L") == 0) // Like
+        *score = 20;
+    else if (strcmp(action, "D") == 0) // Dislike
+        *score = -10;
+    else if (strcmp(action, "C") == 0) // Comment
+        *score = 30;
+    else if (strcmp(action, "S") == 0) // Share
+        *score = 40;
+    else
+        return false;
+
+    return true;
+}
+
+/**
+ * @brief Map stdin one tuple at a time, until the end of the input.
+ */
+void map_input(out_buf_t outs[], int num_reducers)
+{
+    input_t in = {.size = READ_BUF_SIZE};
+    in.buf = malloc(in.size);
+
+    // The ID of the previous tuple, and the reducer it went to.
+    char *prev_id = NULL;
+    size_t prev_id_size = 0;
+    int prev_out = -1;
+
+    while (1)
+    {
+        char *id, *action, *topic;
+        int status = next_tuple(&in, &id, &action, &topic);
+
+        if (status != INPUT_TUPLE)
         {
-            topic = token;
-            token_i = 0;
+            for (int i = 0; i < num_reducers; i++)
+            {
+                if (status == INPUT_JOB_END)
+                    out_end_job(&outs[i]);
+                else
+                    out_flush(&outs[i]);
+            }
+
+            if (status == INPUT_END)
+                break;
+
+            prev_out = -1;
+            continue;
+        }
 
-            // Construct the entry
-            entries[entries_size++] = (entry_t){id, action, topic};
 #if DEBUG
-            printf("\n\tentries[%d] = {%s, %s, %s}\n", entries_size - 1, id, action, topic);
+        printf("Read tuple {%s, %s, %s}\n", id, action, topic);
 #endif
+
+        int score;
+        if (!action_score(action, &score))
+            continue;
+
+        // A new ID means the previous user is complete.
+        if (prev_out == -1 || strcmp(id, prev_id) != 0)
+        {
+            if (prev_out != -1)
+                out_commit(&outs[prev_out]);
+
+            const size_t id_len = strlen(id);
+            if (id_len + 1 > prev_id_size)
+            {
+                prev_id_size = id_len + 1;
+                prev_id = realloc(prev_id, prev_id_size);
+            }
+            memcpy(prev_id, id, id_len + 1);
+
+            prev_out = hash_id(id, id_len) % num_reducers;
         }
 
-        // Get next token
-        token = strtok(NULL, delims);
-    } // End of while
+        if (binary)
+        {
+            frame_append(&outs[prev_out], id, topic, score);
+            continue;
+        }
 
-    // Print all the entries
-#if DEBUG
-    printf("\n\nEntries:\n");
-#endif
+        char line[PIPE_BUF];
+        int len = snprintf(line, sizeof line, "(%s, %s, %d)\n", id, topic, score);
+        if (len >= (int)sizeof line)
+            len = sizeof line - 1;
 
-    for (unsigned i = 0; i < entries_size; i++)
+        out_append(&outs[prev_out], line, len);
+    }
+
+    free(prev_id);
+    free(in.buf);
+}
+
+/**
+ * @brief With -t, report to the combiner on one line: this process's PID, the
+ * time it spent blocked on full output pipes in nanoseconds, and the bytes it
+ * sent each reducer. The line is written with a single write(), so reports
+ * from different mappers don't mix.
+ */
+void write_telemetry(int fd, const out_buf_t outs[], int num_reducers)
+{
+    char line[PIPE_BUF];
+    int len = snprintf(line, sizeof line, "%d %lld", (int)getpid(), blocked_ns);
+
+    for (int i = 0; i < num_reducers; i++)
+        len += snprintf(line + len, sizeof line - len, " %lld", outs[i].written);
+    len += snprintf(line + len, sizeof line - len, "\n");
+
+    write_out(fd, line, len);
+}
+
+int main(int argc, char *argv[])
+{
+    // By default, all output goes to stdout. With -r <no. reducers>, output
+    // is split between that many reducers by hash(id).
+    int num_reducers = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "bjr:tz")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            binary = true;
+            break;
+        case 'j':
+            jobs = true;
+            break;
+        case 'r':
+            num_reducers = atoi(optarg);
+            break;
+        case 't':
+            telemetry = true;
+            break;
+        case 'z':
+            zero_copy = true;
+            break;
+        default:
+            fprintf(stderr, "Usage: mapper [-b] [-j] [-r <no. reducers> [-t]] [-z]\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (num_reducers < 0 || num_reducers > MAX_REDUCERS)
     {
-        entry_t *e = &entries[i];
+        fprintf(stderr, "ERROR: -r must be between 1 and %d.\n", MAX_REDUCERS);
+        exit(EXIT_FAILURE);
+    }
 
-#if DEBUG
-        printf("Read entry {%s, %s, %s}\n", e->id, e->action, e->topic);
-#endif
+    if (telemetry && num_reducers == 0)
+    {
+        fprintf(stderr, "ERROR: -t needs -r.\n");
+        exit(EXIT_FAILURE);
+    }
 
-        // Get cooresponding score from user action
-        int score;
-        if (strcmp(e->action, "P") == 0) // Post
-            score = 50;
-        else if (strcmp(e->action, "L") == 0) // Like
-            score = 20;
-        else if (strcmp(e->action, "D") == 0) // Dislike
-            score = -10;
-        else if (strcmp(e->action, "C") == 0) // Comment
-            score = 30;
-        else if (strcmp(e->action, "S") == 0) // Share
-            score = 40;
+    page_size = sysconf(_SC_PAGESIZE);
 
-        printf("(%s, %s, %d)\n", e->id, e->topic, score);
+    static out_buf_t outs[MAX_REDUCERS];
+    if (num_reducers == 0)
+    {
+        num_reducers = 1;
+        out_init(&outs[0], STDOUT_FILENO, false);
     }
+    else
+    {
+        for (int i = 0; i < num_reducers; i++)
+        {
+            out_init(&outs[i], FIRST_OUT_FD + i, true);
+            if (telemetry)
+                fcntl(outs[i].fd, F_SETFL, fcntl(outs[i].fd, F_GETFL) | O_NONBLOCK);
+        }
+    }
+
+    map_input(outs, num_reducers);
 
-    free(text);
+    if (telemetry)
+        write_telemetry(FIRST_OUT_FD + num_reducers, outs, num_reducers);
     return 0;
 }
@@ -0,0 +1,25 @@
+#ifndef PARTITION_H
+#define PARTITION_H
+
+#include <stddef.h>
+
+/**
+ * @brief FNV-1a hash of a user ID. The combiner and the mapper both use it to
+ * pick a partition for a tuple, so every tuple for an ID goes the same way.
+ * @param id The ID. Need not be NUL-terminated.
+ * @param len Length of the ID in bytes.
+ */
+static inline unsigned long hash_id(const char *id, size_t len)
+{
+    unsigned long hash = 14695981039346656037UL;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char)id[i];
+        hash *= 1099511628211UL;
+    }
+
+    return hash;
+}
+
+#endif
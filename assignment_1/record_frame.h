@@ -0,0 +1,54 @@
+#ifndef RECORD_FRAME_H
+#define RECORD_FRAME_H
+
+#include <stdint.h>
+#include <limits.h> // for PIPE_BUF
+
+/*
+ * Binary format between the mapper and the reducer (-b).
+ *
+ * The stream is a sequence of frames. Each frame is
+ *
+ *   frame_header_t
+ *   num_strings strings: a uint16_t length, the bytes, then a '\0'
+ *   num_records frame_record_t
+ *
+ * Records name their ID and topic by index into the frame's own strings, so a
+ * user's ID is sent once per frame instead of once per tuple. Integers are in
+ * host byte order, since both ends run on the same machine. Nothing in a frame
+ * is aligned; read fields with memcpy().
+ *
+ * In job mode (-j), a frame without strings or records ends a job.
+ */
+
+// Frames are written with one write() each, and mappers may share a
+// reducer's pipe, so a frame must fit in one atomic pipe write.
+#define FRAME_MAX PIPE_BUF
+
+typedef struct frame_header
+{
+    uint32_t frame_len; // Whole frame, header included.
+    uint32_t num_strings;
+    uint32_t num_records;
+} frame_header_t;
+
+typedef struct frame_record
+{
+    uint32_t id;    // Index into the frame's strings.
+    uint32_t topic; // Index into the frame's strings.
+    int32_t score;
+} frame_record_t;
+
+// Smallest possible string: an empty one, length and terminator only.
+#define FRAME_MIN_STRING (sizeof(uint16_t) + 1)
+
+#define FRAME_MAX_STRINGS ((FRAME_MAX - sizeof(frame_header_t)) / FRAME_MIN_STRING)
+#define FRAME_MAX_RECORDS ((FRAME_MAX - sizeof(frame_header_t)) / sizeof(frame_record_t))
+
+/*
+ * In job mode (-j), text streams are a series of jobs, each ended by this
+ * byte.
+ */
+#define JOB_DELIM '\x04'
+
+#endif
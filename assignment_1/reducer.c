@@ -1,154 +1,1027 @@
-#include <stdio.h>  // for printf(), fgetc()
+#include <stdio.h>  // for printf()
 #include <stdlib.h> // for malloc(), atoi()
-#include <string.h> // for strtok()
+#include <string.h> // for memchr()
 #include <stdbool.h>
+#include <unistd.h> // for read(), write()
+#include <limits.h> // for PIPE_BUF
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#define TOTAL_IDS 10
-#define TOTAL_TOPICS 10
+#include "partition.h"
+#include "record_frame.h"
 
-char *ids[TOTAL_IDS];
-char *topics[TOTAL_IDS][TOTAL_TOPICS]; // List of topics for each ID
-int total_score[TOTAL_IDS][TOTAL_TOPICS];
-// Indexes to traverse through the matrix of scores.
-int id_size = 0;
-int topic_sizes[TOTAL_TOPICS] = {0}; // Initialize to 0
+// Initial size of the input buffer. It grows if a tuple doesn't fit.
+#define READ_BUF_SIZE (64 * 1024)
+
+// Output is collected here and written in whole lines, at most PIPE_BUF bytes
+// at a time. Several reducers may share stdout, and writes that small are
+// never interleaved with theirs.
+char out_buf[PIPE_BUF];
+size_t out_len = 0;
+
+void write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "ERROR: Couldn't write reducer output.\n");
+            exit(EXIT_FAILURE);
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+void flush_output(void)
+{
+    write_all(STDOUT_FILENO, out_buf, out_len);
+    out_len = 0;
+}
+
+void emit_score(const char *id, const char *topic, int score)
+{
+    char line[PIPE_BUF];
+    int len = snprintf(line, sizeof line, "(%s, %s, %d)\n", id, topic, score);
+    if (len >= (int)sizeof line)
+        len = sizeof line - 1;
+
+    if (out_len + len > sizeof out_buf)
+        flush_output();
+
+    memcpy(out_buf + out_len, line, len);
+    out_len += len;
+}
 
 /**
- * @brief Read a text file into a buffer.
- * WARNING: You must free() the returned char*!
+ * @brief Reads (id, topic, score) records from a file descriptor, either as
+ * "(id, topic, score)" text tuples or as binary frames (see record_frame.h).
+ *
+ * Input is read in large blocks into one buffer, and records point into it:
+ * they are only valid until the next call to next_record().
  */
-char *read(void)
+typedef struct record_reader
 {
-    const int BUF_SIZE = 1500;
+    int fd;
+    bool binary;
+    bool eof;
 
-    char *buffer = malloc(BUF_SIZE * sizeof *buffer);
-    int index = 0;
+    // In job mode, whether reading stopped at the end of a job rather than
+    // at the end of the input.
+    bool jobs;
+    bool job_end;
+
+    char *buf;
+    size_t size;
+    size_t start; // buf[start, end) has been read but not used yet.
+    size_t end;
+    bool mapped; // buf is all of the input, mapped by reader_map().
+
+    // The strings of the current frame, and how many of its records are
+    // left at buf + start.
+    char *strings[FRAME_MAX_STRINGS];
+    uint32_t num_strings;
+    uint32_t records_left;
+} record_reader_t;
+
+void reader_init(record_reader_t *r, int fd, bool binary)
+{
+    *r = (record_reader_t){.fd = fd, .binary = binary};
+    r->size = READ_BUF_SIZE;
+    r->buf = malloc(r->size);
+}
 
-    int c;
-    while ((c = fgetc(stdin)) != EOF)
+void reader_free(record_reader_t *r)
+{
+    if (r->mapped)
+        munmap(r->buf, r->size);
+    else
+        free(r->buf);
+}
+
+/**
+ * @brief If the input is a regular file, map all of it as the buffer instead
+ * of reading it. Text records are parsed in place, which writes to the
+ * buffer, so the mapping is shared: only use this on a scratch file.
+ * @return false if the input can't be mapped; it is then read as usual.
+ */
+bool reader_map(record_reader_t *r)
+{
+    struct stat st;
+    if (fstat(r->fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return false;
+
+    char *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, 0);
+    if (map == MAP_FAILED)
+        return false;
+
+    free(r->buf);
+    r->buf = map;
+    r->size = r->end = st.st_size;
+    r->start = 0;
+    r->mapped = r->eof = true;
+    return true;
+}
+
+/**
+ * @brief Count the records in a mapped input without using them, by counting
+ * tuples or adding up frame headers.
+ */
+size_t count_records(const record_reader_t *r)
+{
+    size_t count = 0;
+    const char *p = r->buf, *end = r->buf + r->end;
+
+    if (!r->binary)
     {
-        buffer[index++] = c;
-    };
+        while ((p = memchr(p, '(', end - p)) != NULL)
+        {
+            count++;
+            p++;
+        }
+        return count;
+    }
+
+    frame_header_t header;
+    while ((size_t)(end - p) >= sizeof header)
+    {
+        memcpy(&header, p, sizeof header);
+        if (header.frame_len < sizeof header)
+            break; // next_binary_record() reports it.
+        count += header.num_records;
+        p += header.frame_len;
+    }
+    return count;
+}
+
+/**
+ * @brief Read more input, keeping the unused bytes. Makes the buffer bigger
+ * if they fill it.
+ * @return false at the end of the input.
+ */
+bool reader_fill(record_reader_t *r)
+{
+    if (r->eof)
+        return false;
+
+    memmove(r->buf, r->buf + r->start, r->end - r->start);
+    r->end -= r->start;
+    r->start = 0;
+
+    if (r->end == r->size)
+    {
+        r->size *= 2;
+        r->buf = realloc(r->buf, r->size);
+    }
+
+    ssize_t n;
+    while ((n = read(r->fd, r->buf + r->end, r->size - r->end)) == -1 && errno == EINTR)
+        ;
 
-    return buffer;
+    if (n == -1)
+    {
+        fprintf(stderr, "ERROR: Couldn't read reducer input.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (n == 0)
+    {
+        r->eof = true;
+        return false;
+    }
+
+    r->end += n;
+    return true;
 }
 
-void update_total_scores(char *id, char *topic, int score)
+// Skip spaces around a tuple field and terminate it in place.
+char *trim_field(char *begin, char *end)
 {
+    while (begin < end && *begin == ' ')
+        begin++;
+    while (end > begin && end[-1] == ' ')
+        end--;
+    *end = '\0';
+    return begin;
+}
 
-    bool found_id = false;
-    // First, try to find the ID.
-    for (int id_idx = 0; id_idx < id_size; id_idx++)
+bool next_text_record(record_reader_t *r, char **id, char **topic, int *score)
+{
+    while (1)
     {
-        if (strcmp(ids[id_idx], id) == 0)
+        char *p = r->buf + r->start;
+        char *end = r->buf + r->end;
+
+        char *open = memchr(p, '(', end - p);
+
+        if (r->jobs)
         {
-            // Found the relevant ID. Use this i in the matrix to get the topics.
-            found_id = true;
+            char *delim = memchr(p, JOB_DELIM, (open ? open : end) - p);
+            if (delim != NULL)
+            {
+                r->start = delim + 1 - r->buf;
+                r->job_end = true;
+                return false;
+            }
+        }
+
+        char *close_paren = open ? memchr(open, ')', end - open) : NULL;
+
+        if (close_paren == NULL)
+        {
+            // Only separators, or the start of a tuple, are left.
+            r->start = open ? (size_t)(open - r->buf) : r->end;
+            if (!reader_fill(r))
+                return false;
+            continue;
+        }
+
+        r->start = close_paren + 1 - r->buf;
+
+        char *comma1 = memchr(open, ',', close_paren - open);
+        char *comma2 = comma1 ? memchr(comma1 + 1, ',', close_paren - comma1 - 1) : NULL;
+        if (comma2 == NULL)
+            continue; // Not a tuple.
+
+        *id = trim_field(open + 1, comma1);
+        *topic = trim_field(comma1 + 1, comma2);
+        *close_paren = '\0';
+        *score = atoi(comma2 + 1);
+        return true;
+    }
+}
 
-            bool found_topic = false;
-            // Next, find the topic.
-            for (int topic_idx = 0; topic_idx < topic_sizes[id_idx]; topic_idx++)
+bool next_binary_record(record_reader_t *r, char **id, char **topic, int *score)
+{
+    while (r->records_left == 0)
+    {
+        // Have the next frame in the buffer.
+        frame_header_t header;
+        while (1)
+        {
+            const size_t avail = r->end - r->start;
+            if (avail >= sizeof header)
             {
-                if (strcmp(topics[id_idx][topic_idx], topic) == 0)
+                memcpy(&header, r->buf + r->start, sizeof header);
+                if (header.frame_len < sizeof header || header.frame_len > FRAME_MAX ||
+                    header.num_strings > FRAME_MAX_STRINGS)
                 {
-                    found_topic = true;
-                    // We know the index of the id and topic.
-                    // Now we can modify the score.
-                    total_score[id_idx][topic_idx] += score;
+                    fprintf(stderr, "ERROR: Bad frame in reducer input.\n");
+                    exit(EXIT_FAILURE);
                 }
-            } // topic iterator
+                if (avail >= header.frame_len)
+                    break;
+            }
 
-            if (!found_topic)
+            if (!reader_fill(r))
             {
-                // Create the new topic.
-                topics[id_idx][topic_sizes[id_idx]] = topic;
+                if (r->end != r->start)
+                {
+                    fprintf(stderr, "ERROR: Truncated frame in reducer input.\n");
+                    exit(EXIT_FAILURE);
+                }
+                return false;
+            }
+        }
 
-                // Assign the score.
-                total_score[id_idx][topic_sizes[id_idx]] = score;
+        if (r->jobs && header.num_strings == 0 && header.num_records == 0)
+        {
+            r->start += header.frame_len;
+            r->job_end = true;
+            return false;
+        }
 
-                topic_sizes[id_idx]++;
-            }
+        char *p = r->buf + r->start + sizeof header;
+        for (uint32_t i = 0; i < header.num_strings; i++)
+        {
+            uint16_t s_len;
+            memcpy(&s_len, p, sizeof s_len);
+            r->strings[i] = p + sizeof s_len;
+            p += sizeof s_len + s_len + 1;
         }
-    } // ID iterator
 
-    if (!found_id)
+        r->num_strings = header.num_strings;
+        r->records_left = header.num_records;
+        r->start = p - r->buf;
+    }
+
+    frame_record_t record;
+    memcpy(&record, r->buf + r->start, sizeof record);
+    r->start += sizeof record;
+    r->records_left--;
+
+    if (record.id >= r->num_strings || record.topic >= r->num_strings)
+    {
+        fprintf(stderr, "ERROR: Bad record in reducer input.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    *id = r->strings[record.id];
+    *topic = r->strings[record.topic];
+    *score = record.score;
+    return true;
+}
+
+/**
+ * @brief Get the next record.
+ * @return false at the end of the input, or in job mode, at the end of a job
+ * (and then job_end is set).
+ */
+bool next_record(record_reader_t *r, char **id, char **topic, int *score)
+{
+    r->job_end = false;
+    if (r->binary)
+        return next_binary_record(r, id, topic, score);
+    return next_text_record(r, id, topic, score);
+}
+
+/**
+ * @brief Total score per (id, topic).
+ *
+ * Entries are kept in an array in the order they were first seen, which is
+ * also the order they are printed in. An open-addressing index of entry
+ * numbers, with linear probing, finds the entry for a key.
+ */
+typedef struct score_entry
+{
+    char *id;
+    char *topic;
+    unsigned long hash;
+    int score;
+} score_entry_t;
+
+score_entry_t *entries = NULL;
+size_t num_entries = 0;
+size_t entries_size = 0;
+
+// With a mapped input (-f), records stay valid until the end, so entries
+// point at their strings instead of copies.
+bool keep_strings = false;
+
+// Entry number + 1 for each slot, 0 if the slot is empty.
+size_t *slots = NULL;
+size_t num_slots = 0; // Always a power of two.
+
+unsigned long hash_key(const char *id, const char *topic)
+{
+    return hash_id(id, strlen(id)) ^ (hash_id(topic, strlen(topic)) * 31);
+}
+
+void index_entry(size_t i)
+{
+    size_t slot = entries[i].hash & (num_slots - 1);
+    while (slots[slot] != 0)
+        slot = (slot + 1) & (num_slots - 1);
+    slots[slot] = i + 1;
+}
+
+/**
+ * @brief Make the index at least big enough for this many entries, keeping it
+ * at most half full.
+ */
+void reserve_index(size_t count)
+{
+    size_t size = num_slots ? num_slots : 64;
+    while (size < count * 2)
+        size *= 2;
+    if (size == num_slots)
+        return;
+
+    free(slots);
+    num_slots = size;
+    slots = calloc(num_slots, sizeof *slots);
+
+    for (size_t i = 0; i < num_entries; i++)
+        index_entry(i);
+}
+
+// Double the index, keeping it at most half full.
+void grow_index(void)
+{
+    free(slots);
+    num_slots = num_slots ? num_slots * 2 : 64;
+    slots = calloc(num_slots, sizeof *slots);
+
+    for (size_t i = 0; i < num_entries; i++)
+        index_entry(i);
+}
+
+void update_total_scores(const char *id, const char *topic, int score)
+{
+    const unsigned long hash = hash_key(id, topic);
+
+    if (num_slots == 0)
+        grow_index();
+
+    size_t slot = hash & (num_slots - 1);
+    for (; slots[slot] != 0; slot = (slot + 1) & (num_slots - 1))
     {
-        // Print out the last id's topics.
-        // But, only if there is already an ID in the array.
-        if (id_size > 0)
+        score_entry_t *e = &entries[slots[slot] - 1];
+        if (e->hash == hash && strcmp(e->id, id) == 0 && strcmp(e->topic, topic) == 0)
         {
-            // Iterate through the last ID's topics and print them out
-            int last_id = id_size - 1;
-            for (int topic_idx = 0; topic_idx < topic_sizes[last_id]; topic_idx++)
-            {
-                int score = total_score[last_id][topic_idx];
+            e->score += score;
+            return;
+        }
+    }
 
-                printf("(%s, %s, %d)\n", ids[last_id], topics[last_id][topic_idx], score);
-            }
+    // A new key. Most come right after another one of the same user, so
+    // share that entry's copy of the ID.
+    char *id_copy = (char *)id, *topic_copy = (char *)topic;
+    if (!keep_strings)
+    {
+        if (num_entries > 0 && strcmp(entries[num_entries - 1].id, id) == 0)
+            id_copy = entries[num_entries - 1].id;
+        else
+            id_copy = strdup(id);
+        topic_copy = strdup(topic);
+    }
+
+    if (num_entries == entries_size)
+    {
+        entries_size = entries_size ? entries_size * 2 : 64;
+        entries = realloc(entries, entries_size * sizeof *entries);
+    }
+
+    entries[num_entries] = (score_entry_t){id_copy, topic_copy, hash, score};
+    slots[slot] = ++num_entries;
+
+    if (num_entries * 2 > num_slots)
+        grow_index();
+}
+
+/**
+ * @brief Print every entry, in the order they were first seen, and empty the
+ * table.
+ */
+void emit_all(void)
+{
+    for (size_t i = 0; i < num_entries; i++)
+    {
+        score_entry_t *e = &entries[i];
+        emit_score(e->id, e->topic, e->score);
+
+        // Clear its slot. Only the slots of entries are ever used, so this
+        // leaves the index empty without touching all of it.
+        size_t slot = e->hash & (num_slots - 1);
+        while (slots[slot] != i + 1)
+            slot = (slot + 1) & (num_slots - 1);
+        slots[slot] = 0;
+
+        if (keep_strings)
+            continue;
+        if (i + 1 == num_entries || entries[i + 1].id != e->id)
+            free(e->id);
+        free(e->topic);
+    }
+
+    num_entries = 0;
+}
+
+/*
+ * External sort-merge mode (-s <MiB>).
+ *
+ * Records are collected in a fixed-size run buffer. When it is full, they are
+ * sorted by (id, topic), equal keys are added up, and the run is spilled to a
+ * temporary file in the binary frame format. At the end of the input, the
+ * runs are merged with a heap and adjacent equal keys are added up again.
+ *
+ * At most MERGE_FAN_IN runs are merged at once. As soon as there are
+ * MERGE_FAN_IN runs of one level, they are merged into a single run of the
+ * next level, so the number of open run files and read buffers only grows
+ * with the log of the input size.
+ */
+
+#define MERGE_FAN_IN 64
+
+typedef struct run_record
+{
+    const char *id;
+    const char *topic;
+    int score;
+} run_record_t;
+
+// Strings are stored from the front of the run buffer and records from the
+// back, and the run is full when they meet.
+char *run_buf = NULL;
+size_t run_size = 0;
+size_t run_strings_len = 0;
+size_t run_num_records = 0;
+
+run_record_t *run_records(void)
+{
+    return (run_record_t *)(run_buf + run_size) - run_num_records;
+}
+
+int compare_keys(const char *id1, const char *topic1, const char *id2, const char *topic2)
+{
+    int cmp = strcmp(id1, id2);
+    return cmp ? cmp : strcmp(topic1, topic2);
+}
+
+int compare_run_records(const void *a, const void *b)
+{
+    const run_record_t *r1 = a, *r2 = b;
+    return compare_keys(r1->id, r1->topic, r2->id, r2->topic);
+}
+
+/**
+ * @brief Writes sorted records to a file as frames (see record_frame.h).
+ */
+typedef struct run_writer
+{
+    int fd;
+    char buf[READ_BUF_SIZE]; // Whole frames waiting to be written.
+    size_t len;
+
+    // The frame being built.
+    char strings[FRAME_MAX];
+    size_t strings_len;
+    uint32_t num_strings;
+    frame_record_t records[FRAME_MAX_RECORDS];
+    uint32_t num_records;
+
+    // Records are sorted, so a record's ID is most likely the last one's.
+    const char *last_id;
+    uint32_t last_id_index;
+} run_writer_t;
+
+void writer_end_frame(run_writer_t *w)
+{
+    if (w->num_records == 0)
+        return;
+
+    frame_header_t header = {
+        .frame_len = sizeof header + w->strings_len +
+                     w->num_records * sizeof(frame_record_t),
+        .num_strings = w->num_strings,
+        .num_records = w->num_records,
+    };
+
+    if (w->len + header.frame_len > sizeof w->buf)
+    {
+        write_all(w->fd, w->buf, w->len);
+        w->len = 0;
+    }
+
+    char *p = w->buf + w->len;
+    memcpy(p, &header, sizeof header);
+    memcpy(p + sizeof header, w->strings, w->strings_len);
+    memcpy(p + sizeof header + w->strings_len, w->records,
+           w->num_records * sizeof(frame_record_t));
+    w->len += header.frame_len;
+
+    w->strings_len = w->num_strings = w->num_records = 0;
+    w->last_id = NULL;
+}
+
+uint32_t writer_string(run_writer_t *w, const char *str, size_t len)
+{
+    uint16_t s_len = len;
+    memcpy(w->strings + w->strings_len, &s_len, sizeof s_len);
+    memcpy(w->strings + w->strings_len + sizeof s_len, str, len + 1);
+    w->strings_len += sizeof s_len + len + 1;
+    return w->num_strings++;
+}
+
+void writer_add(run_writer_t *w, const char *id, const char *topic, int score)
+{
+    const size_t id_len = strlen(id), topic_len = strlen(topic);
+    const size_t needed = sizeof(frame_record_t) + 2 * FRAME_MIN_STRING + id_len + topic_len;
+
+    if (needed + sizeof(frame_header_t) > FRAME_MAX)
+    {
+        fprintf(stderr, "ERROR: Tuple too long for a frame.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (sizeof(frame_header_t) + w->strings_len +
+            w->num_records * sizeof(frame_record_t) + needed > FRAME_MAX)
+        writer_end_frame(w);
+
+    frame_record_t record = {.score = score};
+
+    if (w->last_id == NULL || strcmp(w->last_id, id) != 0)
+    {
+        w->last_id_index = writer_string(w, id, id_len);
+        w->last_id = w->strings + w->strings_len - id_len - 1;
+    }
+    record.id = w->last_id_index;
+    record.topic = writer_string(w, topic, topic_len);
+
+    w->records[w->num_records++] = record;
+}
+
+void writer_finish(run_writer_t *w)
+{
+    writer_end_frame(w);
+    write_all(w->fd, w->buf, w->len);
+    w->len = 0;
+}
+
+/**
+ * @brief A spilled run, rewound and ready to be read back. Its level is how
+ * many merges its records went through. Levels never increase along runs[].
+ */
+typedef struct run
+{
+    int fd;
+    unsigned level;
+} run_t;
+
+run_t *runs = NULL;
+size_t num_runs = 0;
+
+// Writes a run while it is spilled or merged.
+run_writer_t run_writer;
+
+void merge_last_runs(size_t count);
+
+/**
+ * @brief Sort the run buffer, add up equal keys, and pass each key once to
+ * out(), in order.
+ */
+void sort_run(void (*out)(void *arg, const char *id, const char *topic, int score), void *arg)
+{
+    run_record_t *records = run_records();
+    qsort(records, run_num_records, sizeof *records, compare_run_records);
+
+    for (size_t i = 0; i < run_num_records;)
+    {
+        int score = 0;
+        size_t j = i;
+        for (; j < run_num_records && compare_run_records(&records[i], &records[j]) == 0; j++)
+            score += records[j].score;
+
+        out(arg, records[i].id, records[i].topic, score);
+        i = j;
+    }
+
+    run_strings_len = run_num_records = 0;
+}
+
+void write_to_run(void *w, const char *id, const char *topic, int score)
+{
+    writer_add(w, id, topic, score);
+}
+
+/**
+ * @brief Create a temporary file for a run and start writing it.
+ */
+void run_start(void)
+{
+    FILE *file = tmpfile();
+    if (file == NULL)
+    {
+        fprintf(stderr, "ERROR: Couldn't create a run file.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Keep only the descriptor. It stays open, and the file is deleted
+    // when it is closed.
+    int fd = dup(fileno(file));
+    fclose(file);
+
+    run_writer = (run_writer_t){.fd = fd};
+}
+
+/**
+ * @brief Finish the run being written and add it to runs[]. If that makes
+ * MERGE_FAN_IN runs of its level, merge them.
+ */
+void run_end(unsigned level)
+{
+    writer_finish(&run_writer);
+    lseek(run_writer.fd, 0, SEEK_SET);
+
+    runs = realloc(runs, (num_runs + 1) * sizeof *runs);
+    runs[num_runs++] = (run_t){run_writer.fd, level};
+
+    if (num_runs >= MERGE_FAN_IN && runs[num_runs - MERGE_FAN_IN].level == level)
+        merge_last_runs(MERGE_FAN_IN);
+}
+
+void spill_run(void)
+{
+    run_start();
+    sort_run(write_to_run, &run_writer);
+    run_end(0);
+}
+
+void run_add(const char *id, const char *topic, int score)
+{
+    const size_t id_len = strlen(id) + 1, topic_len = strlen(topic) + 1;
+
+    // Share the last record's copy of the ID if it's the same.
+    run_record_t *last = run_num_records ? run_records() : NULL;
+    const bool same_id = last && strcmp(last->id, id) == 0;
+
+    size_t needed = topic_len + sizeof(run_record_t) + (same_id ? 0 : id_len);
+    if (run_strings_len + run_num_records * sizeof(run_record_t) + needed > run_size)
+    {
+        if (run_num_records == 0)
+        {
+            fprintf(stderr, "ERROR: Tuple bigger than the sort buffer.\n");
+            exit(EXIT_FAILURE);
         }
+        spill_run();
+        run_add(id, topic, score);
+        return;
+    }
 
-        // Create it at the next available index.
-        ids[id_size] = id;
+    char *strings = run_buf + run_strings_len;
+    if (!same_id)
+    {
+        memcpy(strings, id, id_len);
+        strings += id_len;
+    }
+    memcpy(strings, topic, topic_len);
 
-        // Create the new topic.
-        topics[id_size][topic_sizes[id_size]++] = topic;
+    run_record_t record = {same_id ? last->id : run_buf + run_strings_len, strings, score};
+    run_strings_len = strings + topic_len - run_buf;
+    run_num_records++;
+    *run_records() = record;
+}
 
-        // Finally, add the intial score for this new id
-        total_score[id_size][0] = score;
+/**
+ * @brief Passes each key to emit_score() once, adding up the scores of equal
+ * keys that come one after another. If sum_writer is set, keys are written to
+ * that run instead.
+ */
+char *sum_id = NULL;
+char *sum_topic = NULL;
+int sum_score = 0;
+run_writer_t *sum_writer = NULL;
+
+void sum_flush(void)
+{
+    if (sum_id != NULL && sum_writer != NULL)
+        writer_add(sum_writer, sum_id, sum_topic, sum_score);
+    else if (sum_id != NULL)
+        emit_score(sum_id, sum_topic, sum_score);
+    free(sum_id);
+    free(sum_topic);
+    sum_id = sum_topic = NULL;
+}
 
-        id_size++;
+void sum_add(void *arg, const char *id, const char *topic, int score)
+{
+    (void)arg;
+    if (sum_id == NULL || compare_keys(sum_id, sum_topic, id, topic) != 0)
+    {
+        sum_flush();
+        sum_id = strdup(id);
+        sum_topic = strdup(topic);
+        sum_score = 0;
     }
+    sum_score += score;
+}
 
-} // update_total_scores
+typedef struct run_head
+{
+    record_reader_t reader;
+    char *id;
+    char *topic;
+    int score;
+} run_head_t;
 
-int main(void)
+bool head_less(const run_head_t *a, const run_head_t *b)
 {
-    // Read stdin
-    char *text = read();
+    return compare_keys(a->id, a->topic, b->id, b->topic) < 0;
+}
 
-    // Parse the string, token-by-token.
-    char delims[] = "(), \n";
-    char *token = strtok(text, delims);
-    int token_idx = 0;
+void sift_down(run_head_t **heap, size_t size, size_t i)
+{
+    while (1)
+    {
+        size_t min = i, left = 2 * i + 1, right = 2 * i + 2;
+        if (left < size && head_less(heap[left], heap[min]))
+            min = left;
+        if (right < size && head_less(heap[right], heap[min]))
+            min = right;
+        if (min == i)
+            return;
+
+        run_head_t *tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+        i = min;
+    }
+}
+
+/**
+ * @brief Merge the last count runs, passing each key once to sum_add(), in
+ * order. The runs are closed and removed from runs[].
+ */
+void merge_runs(size_t count)
+{
+    run_t *merged = runs + num_runs - count;
+    run_head_t *heads = malloc(count * sizeof *heads);
+    run_head_t **heap = malloc(count * sizeof *heap);
+    size_t heap_size = 0;
 
-    while (token != NULL)
+    for (size_t i = 0; i < count; i++)
     {
-        // Temp variables to hold the values
-        char *id, *topic;
-        int score;
+        reader_init(&heads[i].reader, merged[i].fd, true);
+        if (next_record(&heads[i].reader, &heads[i].id, &heads[i].topic, &heads[i].score))
+        {
+            heap[heap_size++] = &heads[i];
+        }
+        else
+        {
+            reader_free(&heads[i].reader);
+            close(merged[i].fd);
+        }
+    }
+
+    for (size_t i = heap_size; i-- > 0;)
+        sift_down(heap, heap_size, i);
+
+    while (heap_size > 0)
+    {
+        run_head_t *min = heap[0];
+        sum_add(NULL, min->id, min->topic, min->score);
 
-        switch (token_idx)
+        if (!next_record(&min->reader, &min->id, &min->topic, &min->score))
         {
-        case 0:
-            id = token;
-            token_idx++;
+            reader_free(&min->reader);
+            close(merged[min - heads].fd);
+            heap[0] = heap[--heap_size];
+        }
+        sift_down(heap, heap_size, 0);
+    }
+
+    sum_flush();
+    free(heads);
+    free(heap);
+    num_runs -= count;
+}
+
+/**
+ * @brief Merge the last count runs into a new run, one level above the
+ * highest of them.
+ */
+void merge_last_runs(size_t count)
+{
+    const unsigned level = runs[num_runs - count].level + 1;
+
+    run_start();
+    sum_writer = &run_writer;
+    merge_runs(count);
+    sum_writer = NULL;
+    run_end(level);
+}
+
+/**
+ * @brief Reduce all input with the external sort-merge. Output is sorted by
+ * (id, topic).
+ */
+void sort_merge_reduce(record_reader_t *reader, size_t budget)
+{
+    run_size = budget;
+    run_buf = malloc(run_size);
+
+    char *id, *topic;
+    int score;
+    while (next_record(reader, &id, &topic, &score))
+        run_add(id, topic, score);
+
+    if (num_runs == 0)
+    {
+        // Everything fit in memory.
+        sort_run(sum_add, NULL);
+        sum_flush();
+    }
+    else
+    {
+        spill_run();
+
+        // The output comes from a single merge of at most MERGE_FAN_IN runs.
+        while (num_runs > MERGE_FAN_IN)
+            merge_last_runs(MERGE_FAN_IN);
+        merge_runs(num_runs);
+    }
+
+    free(run_buf);
+    free(runs);
+}
+
+int main(int argc, char *argv[])
+{
+    // With -b, input is in binary frames (see record_frame.h).
+    bool binary = false;
+
+    // By default, input is taken to be grouped by ID, and each user's scores
+    // are printed as soon as the next user starts. With -u, input can be in
+    // any order, and all scores are printed at the end.
+    bool grouped = true;
+
+    // With -s <MiB>, use the external sort-merge with a run buffer that big.
+    // Output is then sorted by (id, topic).
+    size_t sort_budget = 0;
+
+    // With -j <no. writers>, input is a series of jobs. Every writer ends
+    // each job with a marker (see record_frame.h), and once all of them have,
+    // the job's scores are printed, followed by JOB_DELIM.
+    int job_writers = 0;
+
+    // With -f, stdin is a scratch file (the combiner's memfd), which is
+    // mapped and parsed in place.
+    bool scratch_input = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "bfj:s:u")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            binary = true;
+            break;
+        case 'f':
+            scratch_input = true;
+            break;
+        case 'j':
+            job_writers = atoi(optarg);
             break;
-        case 1:
-            topic = token;
-            token_idx++;
+        case 's':
+            sort_budget = (size_t)atoi(optarg) * 1024 * 1024;
             break;
-        case 2:
-            score = atoi(token);
+        case 'u':
+            grouped = false;
+            break;
+        default:
+            fprintf(stderr, "Usage: reducer [-b] [-f] [-j <no. writers>] [-u] [-s <MiB>]\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    record_reader_t reader;
+    reader_init(&reader, STDIN_FILENO, binary);
+    reader.jobs = job_writers > 0;
+
+    if (scratch_input && reader_map(&reader))
+    {
+        keep_strings = true;
+
+        // Unordered, every key is kept to the end. All of the input is at
+        // hand, so a first pass can size the index for the worst case, and
+        // it never has to be rebuilt.
+        if (!grouped)
+            reserve_index(count_records(&reader));
+    }
+
+    if (reader.jobs && sort_budget > 0)
+    {
+        fprintf(stderr, "ERROR: -j and -s can't be used together.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (sort_budget > 0)
+    {
+        sort_merge_reduce(&reader, sort_budget);
+        flush_output();
+        reader_free(&reader);
+        return 0;
+    }
+
+    char *id, *topic;
+    int score;
+    int job_ends = 0;
+    while (1)
+    {
+        while (next_record(&reader, &id, &topic, &score))
+        {
+            // A new ID means the previous user is complete.
+            if (grouped && num_entries > 0 && strcmp(entries[num_entries - 1].id, id) != 0)
+                emit_all();
 
             update_total_scores(id, topic, score);
+        }
 
-            token_idx = 0;
+        if (!reader.job_end)
             break;
-        } // switch
 
-        token = strtok(NULL, delims);
-    } // while (token != NULL)
+        // The job is done once every writer has ended it.
+        if (++job_ends < job_writers)
+            continue;
 
-    // Finally, print out very last ID's entries
-    // Iterate through the last ID's topics and print them out
-    int last_id = id_size - 1;
-    for (int topic_idx = 0; topic_idx < topic_sizes[last_id]; topic_idx++)
-    {
-        int score = total_score[last_id][topic_idx];
+        job_ends = 0;
+        emit_all();
+        flush_output();
 
-        printf("(%s, %s, %d)\n", ids[last_id], topics[last_id][topic_idx], score);
+        const char delim = JOB_DELIM;
+        write_all(STDOUT_FILENO, &delim, 1);
     }
 
-    free(text);
+    // Finally, print out the remaining entries
+    emit_all();
+    flush_output();
+
+    reader_free(&reader);
+    free(entries);
+    free(slots);
     return 0;
 } // main
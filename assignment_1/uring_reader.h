@@ -0,0 +1,306 @@
+#ifndef URING_READER_H
+#define URING_READER_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+/*
+ * Reads a regular file with io_uring, keeping URING_DEPTH reads of
+ * URING_BUF_SIZE bytes in flight, and hands the blocks to a callback in file
+ * order, straight from the read buffers. The buffers are registered with the
+ * kernel when possible, so the reads are IORING_OP_READ_FIXED.
+ *
+ * liburing isn't needed: the rings are set up with the raw system calls.
+ */
+
+#define URING_DEPTH 8
+#define URING_BUF_SIZE (256 * 1024)
+
+typedef struct uring
+{
+    int fd;
+
+    // Submission queue
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned to_submit;
+
+    // Completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} uring_t;
+
+/**
+ * @brief One read buffer and the read it is used for.
+ */
+typedef struct uring_slot
+{
+    char *buf;
+    off_t offset; // File offset of buf[0].
+    size_t len;   // Bytes asked for.
+    bool done;
+    int res; // Bytes read, or -errno.
+} uring_slot_t;
+
+static int uring_setup(uring_t *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof params);
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd == -1)
+        return -1;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // Newer kernels map both rings with one mmap().
+    const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap && ring->cq_ring_size > ring->sq_ring_size)
+        ring->sq_ring_size = ring->cq_ring_size;
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+    {
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->cq_ring = ring->sq_ring;
+    if (!single_mmap)
+    {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED)
+        {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(ring->fd);
+            return -1;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        if (!single_mmap)
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->to_submit = 0;
+
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return 0;
+}
+
+static void uring_free(uring_t *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+/**
+ * @brief Queue a read into a slot. It is submitted by the next uring_wait().
+ */
+static void uring_queue_read(uring_t *ring, int file_fd, uring_slot_t slots[], unsigned slot, bool fixed)
+{
+    const unsigned tail = *ring->sq_tail;
+    const unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof *sqe);
+    sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = file_fd;
+    sqe->off = slots[slot].offset;
+    sqe->addr = (uintptr_t)slots[slot].buf;
+    sqe->len = slots[slot].len;
+    sqe->buf_index = slot; // Buffers are registered in slot order.
+    sqe->user_data = slot;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+
+    slots[slot].done = false;
+}
+
+/**
+ * @brief Submit the queued reads, wait for at least one to complete, and mark
+ * every completed one done.
+ * @return 0 on success, -1 on error.
+ */
+static int uring_wait(uring_t *ring, uring_slot_t slots[])
+{
+    while (syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1)
+    {
+        if (errno != EINTR)
+            return -1;
+    }
+    ring->to_submit = 0;
+
+    unsigned head = *ring->cq_head;
+    const unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++)
+    {
+        const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        slots[cqe->user_data].res = cqe->res;
+        slots[cqe->user_data].done = true;
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * @brief Read all of a regular file with io_uring, calling deliver() with each
+ * block in file order. A block is only valid during the call.
+ * @return 0 on success, -1 if io_uring can't be used for this file (then
+ * nothing has been delivered, and the caller should read it another way).
+ * Exits on read errors.
+ */
+static int uring_read_file(int file_fd, void (*deliver)(void *arg, const char *buf, size_t len), void *arg)
+{
+    struct stat st;
+    if (fstat(file_fd, &st) == -1 || !S_ISREG(st.st_mode))
+        return -1;
+
+    // Reads start at the current offset, as read() would.
+    off_t next_offset = lseek(file_fd, 0, SEEK_CUR);
+    if (next_offset == -1)
+        return -1;
+
+    uring_t ring;
+    if (uring_setup(&ring, URING_DEPTH) == -1)
+        return -1;
+
+    char *bufs = mmap(NULL, URING_DEPTH * URING_BUF_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufs == MAP_FAILED)
+    {
+        uring_free(&ring);
+        return -1;
+    }
+
+    uring_slot_t slots[URING_DEPTH];
+    struct iovec iovs[URING_DEPTH];
+    for (unsigned i = 0; i < URING_DEPTH; i++)
+    {
+        slots[i] = (uring_slot_t){.buf = bufs + (size_t)i * URING_BUF_SIZE};
+        iovs[i] = (struct iovec){slots[i].buf, URING_BUF_SIZE};
+    }
+
+    // Registered buffers are pinned once instead of on every read. Without
+    // them (e.g. a low RLIMIT_MEMLOCK), plain reads still work.
+    const bool fixed = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS,
+                               iovs, URING_DEPTH) == 0;
+
+    // Start a read in every slot. Slots are used round-robin, so the next
+    // block to deliver is always in slot (delivered % URING_DEPTH).
+    unsigned in_flight = 0;
+    for (unsigned i = 0; i < URING_DEPTH && next_offset < st.st_size; i++)
+    {
+        slots[i].offset = next_offset;
+        slots[i].len = URING_BUF_SIZE;
+        uring_queue_read(&ring, file_fd, slots, i, fixed);
+        next_offset += URING_BUF_SIZE;
+        in_flight++;
+    }
+
+    for (unsigned next = 0; in_flight > 0; next = (next + 1) % URING_DEPTH)
+    {
+        uring_slot_t *slot = &slots[next];
+
+        while (!slot->done)
+        {
+            if (uring_wait(&ring, slots) == -1)
+            {
+                fprintf(stderr, "ERROR: io_uring_enter() failed.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        if (slot->res == -EINTR || slot->res == -EAGAIN)
+        {
+            uring_queue_read(&ring, file_fd, slots, next, fixed);
+            next = (next + URING_DEPTH - 1) % URING_DEPTH; // Wait on it again.
+            continue;
+        }
+
+        if (slot->res < 0)
+        {
+            fprintf(stderr, "ERROR: Couldn't read input: %s\n", strerror(-slot->res));
+            exit(EXIT_FAILURE);
+        }
+
+        if (slot->res > 0)
+            deliver(arg, slot->buf, slot->res);
+
+        if (slot->res > 0 && (size_t)slot->res < slot->len)
+        {
+            // A short read before the end of the file. Read the rest of the
+            // block into the same slot before moving on.
+            slot->offset += slot->res;
+            slot->len -= slot->res;
+            uring_queue_read(&ring, file_fd, slots, next, fixed);
+            next = (next + URING_DEPTH - 1) % URING_DEPTH;
+            continue;
+        }
+
+        in_flight--;
+
+        if (slot->res > 0 && next_offset < st.st_size)
+        {
+            slot->offset = next_offset;
+            slot->len = URING_BUF_SIZE;
+            uring_queue_read(&ring, file_fd, slots, next, fixed);
+            next_offset += URING_BUF_SIZE;
+            in_flight++;
+        }
+    }
+
+    munmap(bufs, URING_DEPTH * URING_BUF_SIZE);
+    uring_free(&ring);
+    return 0;
+}
+
+#endif
@@ -1,15 +1,27 @@
+#include <dirent.h>
+#include <getopt.h>
 #include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <iomanip>
 #include <iostream>
 #include <queue>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "flat_score_table.hpp"
+
 // Enable print debugging
 // #define DEBUG
 
@@ -32,14 +44,28 @@ pthread_mutex_t cout_lock;
 using std::string;
 using std::unordered_map;
 
-using id_type = string;
-using topic_type = string;
+// IDs and topics are interned to small integers by the mappers.
+using id_type = uint32_t;
+using topic_type = uint32_t;
 using score_type = int;
 
-// Struct to hold arguments passed from main to mapper worker thread.
+// A (partial) table of total scores: (id, topic) -> score.
+using score_table = flat_score_table;
+
+// Every partial score table is split into this many buckets by ID hash. The
+// final merge hands out whole buckets to threads, so no two threads ever
+// touch the same IDs.
+const size_t NUM_MERGE_BUCKETS = 64;
+
+// Elastic scaling: how often the monitor samples the reducer queues, and how
+// many samples in a row must agree before it adds or retires a reducer.
+const useconds_t MONITOR_INTERVAL_US = 10000;
+const int GROW_AFTER_SAMPLES = 3;
+const int SHRINK_AFTER_SAMPLES = 20;
+
+// Struct to hold arguments passed from main to mapper worker threads.
 struct mapper_args_t {
     size_t buf_size;
-    char *text;
 };
 
 // Struct to hold output from the mapper.
@@ -49,6 +75,95 @@ struct mapped_data {
     score_type score;
 };
 
+/**
+ * @brief Hash an interned ID, for choosing its reducer and merge bucket.
+ */
+inline size_t id_hash(id_type id) { return flat_score_table::mix(id); }
+
+/**
+ * @brief Pick the merge bucket for an ID hash. This uses different bits from
+ * the reducer choice, so buckets stay spread out no matter how many reducers
+ * there are.
+ */
+inline size_t merge_bucket(size_t id_hash) {
+    return (id_hash >> 16) % NUM_MERGE_BUCKETS;
+}
+
+/**
+ * @brief Thread-safe table that hands out a small integer for each distinct
+ * string. Mappers keep their own cache in front of it, so the lock is only
+ * taken the first time a mapper sees a string.
+ */
+struct string_interner {
+    unordered_map<string, uint32_t> ids;
+    std::deque<string> names;  // id -> string. A deque never moves them.
+    pthread_mutex_t lock;
+
+    string_interner() { pthread_mutex_init(&lock, NULL); }
+    ~string_interner() { pthread_mutex_destroy(&lock); }
+
+    uint32_t intern(const string &str) {
+        pthread_mutex_lock(&lock);
+        const auto result = ids.emplace(str, names.size());
+        if (result.second) names.push_back(str);
+        const auto id = result.first->second;
+        pthread_mutex_unlock(&lock);
+        return id;
+    }
+
+    /**
+     * @brief Look up an interned string. Only safe once every mapper is done.
+     */
+    const string &name(uint32_t id) const { return names[id]; }
+};
+
+string_interner user_ids, topic_ids;
+
+// Map that coorelates an action to its cooresponding point value.
+const unordered_map<string, int> action_points{
+    {"P", 50}, {"L", 20}, {"D", -10}, {"C", 30}, {"S", 40}};
+
+/**
+ * @brief Record filters from the command line. Compiled into lookup tables
+ * before any mapper starts and read-only afterwards. A filter that wasn't
+ * given lets everything through.
+ */
+struct record_filter_t {
+    bool filter_actions = false;
+    std::array<bool, 256> actions{};  // Indexed by the action's letter.
+
+    bool filter_users = false;
+    std::unordered_set<string> users;
+
+    // The filter topics are interned up front. Mappers look topics up here
+    // instead of interning them, so topics that fail never take the shared
+    // interner's lock or grow it.
+    bool filter_topics = false;
+    unordered_map<string, uint32_t> topics;
+} record_filter;
+
+/**
+ * @brief User ID -> segment, from the --segments file. Loaded before any
+ * mapper starts and shared read-only by all of them. Segments are interned
+ * as IDs, so mappers re-key each tuple to its user's segment and the
+ * reducers aggregate per segment.
+ */
+bool join_segments = false;
+unordered_map<string, id_type> user_segments;
+
+/**
+ * @brief Intern a string, checking the calling mapper's cache first.
+ */
+uint32_t intern_cached(string_interner &interner,
+                       unordered_map<string, uint32_t> &cache,
+                       const char *str) {
+    auto it = cache.find(str);
+    if (it == cache.end()) {
+        it = cache.emplace(str, interner.intern(str)).first;
+    }
+    return it->second;
+}
+
 #ifdef DEBUG
 // For debug-printing the map object.
 std::ostream &operator<<(std::ostream &out, const mapped_data &o) {
@@ -58,29 +173,41 @@ std::ostream &operator<<(std::ostream &out, const mapped_data &o) {
 #endif
 
 /**
- * Connection from the mapper worker to
+ * Connection from the mapper workers to
  * a single reducer worker. Includes a
- * queue, mutexes, cond vars, and an id.
- *
- * mapper worker will use ID from struct
- * to choose which queue to send the data through
+ * queue, mutexes, cond vars, and the
+ * reducer's share of the total scores.
  *
- * Could just have a vector/map of these structs to hold
- * them or vector::find?
+ * Mapper workers hash the user ID to choose
+ * which active connection to send the data
+ * through. When the number of active reducers
+ * changes, an ID may move to another reducer;
+ * the final merge adds up its partial totals.
  */
 struct ReducerConnection {
-    id_type id;
     std::queue<mapped_data> q;
     pthread_mutex_t q_lock;
     pthread_cond_t q_full_cond, q_empty_cond;
     bool q_full = false;
     bool q_empty = true;
 
-    // Default constructor (should not be called)
-    ReducerConnection() {}
+    // Set by the monitor when this reducer is no longer routed to. The
+    // reducer drains its queue and exits.
+    bool retiring = false;
+
+    // Nanoseconds mappers spent waiting on this full queue since the
+    // monitor last looked. Guarded by q_lock.
+    long long stall_ns = 0;
+
+    pthread_t thread;
+    bool running = false;  // Only touched by main and the monitor.
 
-    // Use this constructor instead
-    ReducerConnection(const id_type id) : id(id) {
+    // This reducer's partial results, split into merge buckets. Only the
+    // owning reducer touches them until it has been joined, so they need no
+    // lock.
+    std::vector<score_table> total_scores{NUM_MERGE_BUCKETS};
+
+    ReducerConnection() {
         pthread_mutex_init(&q_lock, NULL);
         pthread_cond_init(&q_empty_cond, NULL);
         pthread_cond_init(&q_full_cond, NULL);
@@ -94,67 +221,229 @@ struct ReducerConnection {
 };
 
 /**
- * Connections between producer and consumer threads.
- * Includes queues for data passing, mutexes, and condition variables.
+ * Connections between producer and consumer threads, one per possible
+ * reducer. Sized for the maximum reducer count once in main() before any
+ * thread starts, so the vector itself is never modified concurrently.
  */
-unordered_map<id_type, ReducerConnection> thread_conns;
-pthread_mutex_t thread_conns_lock;
+std::vector<ReducerConnection> thread_conns;
+
+// Mappers route to thread_conns[0, active_reducers). Mappers hold the read
+// lock while routing and pushing a tuple (but not while waiting on a full
+// queue); the monitor takes the write lock to change the count, so no tuple
+// is ever pushed to a retired reducer.
+size_t active_reducers = 0;
+pthread_rwlock_t active_reducers_lock;
+
+// Input files still to be mapped. Mapper workers pull the next path from
+// this list until it runs dry. "-" means stdin.
+std::vector<string> input_paths;
+size_t next_input = 0;
+pthread_mutex_t input_paths_lock;
+
+// Number of mapper workers that have not finished yet. The last one to
+// finish raises mapper_done.
+int mappers_running = 0;
+pthread_mutex_t mappers_running_lock;
+
+// A global flag to tell reducer workers whether the mappers have finished
+// producing data. Once this flag turns true, reducers know once the queue is
+// empty, it's time to terminate.
+std::atomic<bool> mapper_done(false);
 
-// Vector of pthread IDs (for joining)
-std::vector<pthread_t> reducer_workers;
+/**
+ * @brief Read an entire stream into a string.
+ */
+string readTextFile(FILE *fp) {
+    string text;
+    char chunk[1 << 16];
 
-// Reducer workers do their work in this map.
-unordered_map<id_type, unordered_map<topic_type, score_type>> total_scores;
-pthread_mutex_t total_scores_lock;
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof chunk, fp)) > 0) {
+        text.append(chunk, n);
+    }
 
-// A global flag to tell reducer workers whether the mapper has finished
-// producing data. Once this flag turns true, reducers know once the queue is
-// empty, it's time to terminate. This does not need a mutex because only one
-// thread writes to it, mapper_worker.
-bool mapper_done = false;
+    return text;
+}
+
+/**
+ * @brief Load the user -> segment file. It holds (user ID, segment) pairs,
+ * written either as tuples like the input or one "ID,segment" per line.
+ */
+void load_segments(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        std::cerr << "ERROR: Couldn't open segments file \"" << path
+                  << "\".\n";
+        exit(EXIT_FAILURE);
+    }
 
-void *reducer_worker(void *args);
+    auto text = readTextFile(fp);
+    fclose(fp);
+
+    const auto delims = "(), \t\n";
+    char *rest = &text[0];
+    char *user;
+
+    while ((user = strtok_r(rest, delims, &rest))) {
+        const char *segment = strtok_r(rest, delims, &rest);
+        if (!segment) {
+            std::cerr << "ERROR: User \"" << user
+                      << "\" has no segment in the segments file.\n";
+            exit(EXIT_FAILURE);
+        }
+
+        user_segments[user] = user_ids.intern(segment);
+    }
+
+    join_segments = true;
+}
 
 /**
- * @brief Read a text file into a buffer.
- * WARNING: You must free() the returned char*!
+ * @brief Split a comma-separated command line list into its items.
  */
-char *readTextFile(void) {
-    const int BUF_SIZE = 1500;
+std::vector<string> split_list(const char *list) {
+    std::vector<string> items;
+    const char *start = list;
+
+    while (true) {
+        const char *end = std::strchr(start, ',');
+        if (!end) end = start + std::strlen(start);
 
-    char *buffer = (char *)malloc(BUF_SIZE * sizeof *buffer);
+        if (end != start) items.emplace_back(start, end);
+        if (!*end) break;
+        start = end + 1;
+    }
+
+    return items;
+}
+
+/**
+ * @brief Expand the paths given on the command line into a list of input
+ * files. Directories contribute every regular file directly inside them, in
+ * name order so runs are reproducible.
+ */
+std::vector<string> expand_input_paths(char *const paths[], int num_paths) {
+    std::vector<string> files;
 
-    int index = 0;
+    for (int i = 0; i < num_paths; i++) {
+        const string path = paths[i];
 
-    int c;
-    while ((c = fgetc(stdin)) != EOF) {
-        buffer[index++] = c;
-    };
+        struct stat st;
+        if (path != "-" && stat(path.c_str(), &st) == -1) {
+            std::cerr << "ERROR: Couldn't stat input \"" << path << "\".\n";
+            exit(EXIT_FAILURE);
+        }
 
-    return buffer;
+        if (path == "-" || !S_ISDIR(st.st_mode)) {
+            files.push_back(path);
+            continue;
+        }
+
+        DIR *dir = opendir(path.c_str());
+        if (!dir) {
+            std::cerr << "ERROR: Couldn't open directory \"" << path << "\".\n";
+            exit(EXIT_FAILURE);
+        }
+
+        std::vector<string> dir_files;
+        while (const auto entry = readdir(dir)) {
+            const auto file = path + "/" + entry->d_name;
+            if (stat(file.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+                dir_files.push_back(file);
+            }
+        }
+        closedir(dir);
+
+        std::sort(dir_files.begin(), dir_files.end());
+        files.insert(files.end(), dir_files.begin(), dir_files.end());
+    }
+
+    return files;
 }
 
 /**
- * @param args A struct containing a buffer size and a char* to the input text.
+ * @brief Monotonic clock reading in nanoseconds.
  */
-void *mapper_worker(void *args) {
-    // Unpack args
-    mapper_args_t &mapper_args = *static_cast<mapper_args_t *>(args);
+long long now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-    auto text = mapper_args.text;
-    const auto BUF_SIZE = mapper_args.buf_size;
+/**
+ * @brief Send a mapped tuple to the reducer that currently owns its ID.
+ * Blocks while that reducer's queue is full, which throttles every mapper
+ * feeding it.
+ *
+ * The read lock on active_reducers is not held while waiting, so the monitor
+ * can grow the pool in the meantime. The tuple is routed again after every
+ * wait.
+ */
+void send_to_reducer(mapped_data &&m_data, const size_t BUF_SIZE) {
+    const auto hash = id_hash(m_data.id);
 
-    const auto delims = "(), \n";
+    while (true) {
+        pthread_rwlock_rdlock(&active_reducers_lock);
+
+        const auto r_idx = hash % active_reducers;
+        auto &r_con = thread_conns[r_idx];
+
+        pthread_mutex_lock(&r_con.q_lock);
+
+        if (!r_con.q_full) {
+            r_con.q.push(std::move(m_data));
+
+            // Now that we've pushed a new item, tell the reducer that the
+            // queue is no longer empty.
+            r_con.q_empty = false;
+            pthread_cond_signal(&r_con.q_empty_cond);
 
-    // Map that coorelates an action to its cooresponding point value.
-    const unordered_map<string, int> action_points{
-        {"P", 50}, {"L", 20}, {"D", -10}, {"C", 30}, {"S", 40}};
+            // However, it may be full.
+            if (r_con.q.size() >= BUF_SIZE) {
+                r_con.q_full = true;
+            }
+
+            pthread_mutex_unlock(&r_con.q_lock);
+            pthread_rwlock_unlock(&active_reducers_lock);
+            return;
+        }
+
+        // Wait for queue to have room to push a new one (AKA wait for not
+        // full). The reducer can't exit while its queue is full, so it will
+        // wake us even if it is retired meanwhile.
+        pthread_rwlock_unlock(&active_reducers_lock);
+        const auto stall_start = now_ns();
+
+        while (r_con.q_full) {
+#ifdef DEBUG
+            COUT_SYNC(
+                "\033[33;1m[m] queue full. Waiting for reducer to consume "
+                "some elements...\033[0m\n")
+#endif
+
+            pthread_cond_wait(&r_con.q_full_cond, &r_con.q_lock);
+        }
+
+        r_con.stall_ns += now_ns() - stall_start;
+        pthread_mutex_unlock(&r_con.q_lock);
+    }
+}
+
+/**
+ * @brief Tokenize one input text and send each tuple to its reducer.
+ */
+void map_text(char *text, const size_t BUF_SIZE) {
+    const auto delims = "(), \n";
+    const auto &filter = record_filter;
 
     // Make temp variables the tokenizer will use
     char *token;  // Substring of input text that represents a single token.
 
     // Used by strtok_r to preserve tokenizer state.
-    char *rest = static_cast<char *>(text);
+    char *rest = text;
+
+    // This mapper's view of the interned IDs and topics.
+    thread_local unordered_map<string, uint32_t> user_cache, topic_cache;
 
     // Get each token from the string.
     while ((token = strtok_r(rest, delims, &rest))) {
@@ -167,6 +456,7 @@ void *mapper_worker(void *args) {
         }
 
         const auto score = action_points.at(token);  // Cooresponding score
+        const auto action = (unsigned char)token[0];
 
         // Move on to next token
         if (!(token = strtok_r(rest, delims, &rest))) {
@@ -176,105 +466,95 @@ void *mapper_worker(void *args) {
 
         const auto topic = token;
 
-        // All the tokens are collected! Construct the mapped tuple object.
-        mapped_data m_data{id, topic, score};
-
-#ifdef DEBUG
-        COUT_SYNC("[m] parsed data: " << m_data << "\n")
-#endif
-        // TODO check if we have added too many reducer threads and print a
-        // warning or something?
-
-        // Time to push the data to the appropriate reducer thread.
-        // First, get the struct with IPC stuff
-
-        // Test to see if the element exists in the map.
-        pthread_mutex_lock(&thread_conns_lock);
-        if (thread_conns.find(id) == thread_conns.end()) {
-            // It wasn't. Make one and add it to the map.
+        // All the tokens are collected. Drop the tuple here if a filter
+        // rejects it, cheapest check first, so it is never queued. Users and
+        // topics are checked before interning, so rejected ones never reach
+        // the shared interner.
+        if (filter.filter_actions && !filter.actions[action]) continue;
+
+        if (filter.filter_users && !filter.users.count(id)) continue;
+
+        uint32_t topic_id;
+        if (filter.filter_topics) {
+            const auto it = filter.topics.find(topic);
+            if (it == filter.topics.end()) continue;
+            topic_id = it->second;
+        } else {
+            topic_id = intern_cached(topic_ids, topic_cache, topic);
+        }
 
-            thread_conns.emplace(id, ReducerConnection(id));
+        // With a segments file, the user's segment takes its place. Users
+        // missing from the file are dropped, like an inner join.
+        id_type out_id;
+        if (join_segments) {
+            const auto segment = user_segments.find(id);
+            if (segment == user_segments.end()) continue;
+            out_id = segment->second;
+        } else {
+            out_id = intern_cached(user_ids, user_cache, id);
+        }
 
-            auto &r_con = thread_conns.at(id);
+        // Construct the mapped tuple object.
+        mapped_data m_data{out_id, topic_id, score};
 
 #ifdef DEBUG
-            COUT_SYNC("[m] creating a new reducer thread for ID \"" << r_con.id
-                                                                    << "\"\n")
+        COUT_SYNC("[m] parsed data: " << m_data << "\n")
 #endif
 
-            pthread_t new_reducer_thread;
-
-            // Save this pthread in the global vector.
-            // This should be ok because pthread_t is a primitive type.
-            // TODO verify this
-            reducer_workers.push_back(new_reducer_thread);
-
-            // Start the thread
-            pthread_create(&new_reducer_thread, NULL, reducer_worker,
-                           &r_con.id);
-        }  // end of if
-
-        // Now, the reducer connection should be in the map. Get a reference
-        // to it.
-        auto &r_con = thread_conns.at(id);
-
-        // We should be able to do this here, because r_con points to a single
-        // part of thread_conns that has its own mutexes.
-        pthread_mutex_unlock(&thread_conns_lock);
-
-        // Send data to the worker
-        pthread_mutex_lock(&r_con.q_lock);
+        send_to_reducer(std::move(m_data), BUF_SIZE);
+    }  // end of while
+}
 
-        // Wait for queue to have room to push a new one (AKA wait for not
-        // full)
-        while (r_con.q_full) {
-#ifdef DEBUG
-            COUT_SYNC(
-                "\033[33;1m[m] queue full. Waiting for reducer to consume some "
-                "elements...\033[0m\n")
-#endif
+/**
+ * @brief mapper worker. Pulls input files off the shared list and maps them
+ * until none are left.
+ * @param args A struct containing the buffer size.
+ */
+void *mapper_worker(void *args) {
+    // Unpack args
+    mapper_args_t &mapper_args = *static_cast<mapper_args_t *>(args);
+    const auto BUF_SIZE = mapper_args.buf_size;
 
-            pthread_cond_wait(&r_con.q_full_cond, &r_con.q_lock);
+    while (true) {
+        // Claim the next input file.
+        pthread_mutex_lock(&input_paths_lock);
+        if (next_input == input_paths.size()) {
+            pthread_mutex_unlock(&input_paths_lock);
+            break;
         }
-
-        // At this point, queue is not full.
+        const auto path = input_paths[next_input++];
+        pthread_mutex_unlock(&input_paths_lock);
 
 #ifdef DEBUG
-        COUT_SYNC("[m] queue is currently not full. Sending data...\n")
+        COUT_SYNC("[m] mapping \"" << path << "\"\n")
 #endif
 
-        r_con.q.push(m_data);
-
-        // Now that we've pushed a new item, tell other
-        // threads that the queue is no longer empty.
-        r_con.q_empty = false;
-        pthread_cond_signal(&r_con.q_empty_cond);
-
-        // TODO: above line wakes up a reducer *every* time.
-        // Instead, wake the reducer when the buffer is full
-        // (in context of having reducers for each user ID)
-        // - more efficient, probably less error-prone too
-
-        // However, it may be full.
-        if (r_con.q.size() == BUF_SIZE) {
-            r_con.q_full = true;
+        FILE *fp = path == "-" ? stdin : fopen(path.c_str(), "r");
+        if (!fp) {
+            std::cerr << "ERROR: Couldn't open input \"" << path << "\".\n";
+            exit(EXIT_FAILURE);
         }
 
-        pthread_mutex_unlock(&r_con.q_lock);
+        auto text = readTextFile(fp);
+        if (fp != stdin) fclose(fp);
 
-#ifdef DEBUG
-        COUT_SYNC("[m] Done sending this tuple. Restarting...\n")
-#endif
-    }  // end of while
+        map_text(&text[0], BUF_SIZE);
+    }
 
 #ifdef DEBUG
     COUT_SYNC(
-        "\033[32;1m[m] Finished parsing all the tokens. "
+        "\033[32;1m[m] No input files left. "
         "Terminating...\033[0m\n")
 #endif
 
-    // No more tokens to parse. Alert reducer threads that the mapper has
-    // finished.
+    pthread_mutex_lock(&mappers_running_lock);
+    const bool last_mapper = --mappers_running == 0;
+    pthread_mutex_unlock(&mappers_running_lock);
+
+    if (!last_mapper) return nullptr;
+
+    // No more tokens to parse anywhere. Alert reducer threads that the
+    // mappers have finished.
     mapper_done = true;
 
     // One problem: Some reducers may be waiting for the queue to fill up.
@@ -285,65 +565,34 @@ void *mapper_worker(void *args) {
         "Signaling to any stalled threads that it's no longer empty...\n");
 #endif
 
-    pthread_mutex_lock(&thread_conns_lock);
-
     for (auto &thread_conn : thread_conns) {
-        pthread_cond_signal(&thread_conn.second.q_empty_cond);
+        pthread_mutex_lock(&thread_conn.q_lock);
+        pthread_cond_signal(&thread_conn.q_empty_cond);
+        pthread_mutex_unlock(&thread_conn.q_lock);
     }
-    pthread_mutex_unlock(&thread_conns_lock);
 
     return nullptr;
 }  // end of mapper
 
 /**
  * @brief reducer worker
+ * @param args Pointer to this reducer's ReducerConnection.
  * @return void* (unused, void* is here for the pthread create interface.)
  */
 void *reducer_worker(void *args) {
-    // Get mapper connection from args
-    string &r_id = *static_cast<string *>(args);
-
-#ifdef DEBUG
-    COUT_SYNC("[r " << pthread_self() << "] r_id = " << r_id << "\n")
-#endif
-
-    // Get mapper connection data structures
-    pthread_mutex_lock(&thread_conns_lock);
-
-    if (thread_conns.find(r_id) == thread_conns.end()) {
-        std::cerr << "Error: reducer can't find thread connection obj for id "
-                  << r_id << "\n";
-        exit(EXIT_FAILURE);
-    }
-
-    // We were able to find it, so grab it.
-    auto &m_conn = thread_conns.at(r_id);
-
-    pthread_mutex_unlock(&thread_conns_lock);
+    auto &m_conn = *static_cast<ReducerConnection *>(args);
 
 #ifdef DEBUG
-    COUT_SYNC("[r " << pthread_self() << "] Starting for user id:" << m_conn.id
-                    << "\n")
+    COUT_SYNC("[r " << pthread_self() << "] Starting\n")
 #endif
 
     while (true) {
         pthread_mutex_lock(&m_conn.q_lock);
 
-        // If mapper_done flag is asserted, and the queue is empty,
-        // There is no more work to be done. Terminate this thread.
-        if (mapper_done and m_conn.q_empty) {
-#ifdef DEBUG
-            COUT_SYNC("\033[32;1m[r "
-                      << pthread_self()
-                      << "] Mapper is done, and I have nothing left in "
-                         "my queue. I'm done!\033[0m\n")
-#endif
-            pthread_mutex_unlock(&m_conn.q_lock);  // probably unnecessary
-            return nullptr;
-        }
-
-        // Wait for queue to have elements (AKA wait for not empty)
-        while (m_conn.q_empty) {
+        // Wait for queue to have elements (AKA wait for not empty), unless
+        // nothing more will arrive: either the mappers are done, or this
+        // reducer has been retired.
+        while (m_conn.q_empty && !mapper_done && !m_conn.retiring) {
 #ifdef DEBUG
             COUT_SYNC(
                 "\033[33;1m[r "
@@ -352,36 +601,27 @@ void *reducer_worker(void *args) {
                    "worker to alert us that it is no longer empty...\033[0m\n")
 #endif
             pthread_cond_wait(&m_conn.q_empty_cond, &m_conn.q_lock);
-
-            if (mapper_done) {
-                // The mapper must have signaled just before it terminated.
-                // Otherwise, the previous mapper_done clause would have
-                // Terminated this thread. That means the mapper finished
-                // this thread's ID while it was waiting, and this thread
-                // can safely terminate.
-#ifdef DEBUG
-                COUT_SYNC("\033[32;1m[r "
-                          << pthread_self()
-                          << "] mapper finished while I was waiting for new "
-                             "data. I'm terminating.\033[0m\n")
-#endif
-
-                pthread_mutex_unlock(&m_conn.q_lock);  // probably unnecessary
-                return nullptr;
-            }
         }
 
+        // If nothing more will arrive and the queue is empty, there is no
+        // more work to be done. Terminate this thread.
+        if (m_conn.q_empty) {
 #ifdef DEBUG
-        COUT_SYNC("[r " << pthread_self()
-                        << "] queue is currently not empty. Fetching data...\n")
+            COUT_SYNC("\033[32;1m[r "
+                      << pthread_self()
+                      << "] Mappers are done or I was retired, and I have "
+                         "nothing left in my queue. I'm done!\033[0m\n")
 #endif
+            pthread_mutex_unlock(&m_conn.q_lock);
+            return nullptr;
+        }
 
-        const auto data = m_conn.q.front();
+        const auto data = std::move(m_conn.q.front());
         m_conn.q.pop();
 
-        // It's no longer full. Alert mapper.
+        // It's no longer full. Alert mappers.
         m_conn.q_full = false;
-        pthread_cond_signal(&m_conn.q_full_cond);
+        pthread_cond_broadcast(&m_conn.q_full_cond);
 
         // However, it may be empty.
         if (m_conn.q.empty()) {
@@ -390,35 +630,242 @@ void *reducer_worker(void *args) {
         pthread_mutex_unlock(&m_conn.q_lock);
 
 #ifdef DEBUG
-        COUT_SYNC("[r " << pthread_self() << "] attempting to change id "
-                        << data.id << ", topic " << data.topic << "...\n")
+        COUT_SYNC("[r " << pthread_self() << "] attempting to change id #"
+                        << data.id << ", topic #" << data.topic << "...\n")
 #endif
-        // Increment score for each one.
-        pthread_mutex_lock(&total_scores_lock);
+        // Increment score in this reducer's own partial table.
+        auto &bucket = m_conn.total_scores[merge_bucket(id_hash(data.id))];
+        bucket.add(data.id, data.topic, data.score);
+    }  // end of while(true)
+
+    return nullptr;
+}
+
+/**
+ * @brief Start the reducer thread for a connection, first joining the thread
+ * that served it before it was retired, if any. Its partial totals are kept.
+ */
+void start_reducer(ReducerConnection &r_con) {
+    if (r_con.running) pthread_join(r_con.thread, NULL);
+
+    r_con.retiring = false;
+    r_con.running = true;
+    pthread_create(&r_con.thread, NULL, reducer_worker, &r_con);
+}
+
+// Bounds for elastic scaling, from the command line.
+struct monitor_args_t {
+    size_t buf_size;
+    size_t min_reducers, max_reducers;
+};
+
+/**
+ * @brief monitor worker. Samples the depth of every active reducer queue and
+ * the time mappers spent stalled on them. Adds a reducer when the queues stay
+ * full, and retires one when they stay nearly empty.
+ * @param args A struct containing the buffer size and reducer count bounds.
+ * @return void* (unused, void* is here for the pthread create interface.)
+ */
+void *monitor_worker(void *args) {
+    const auto &monitor_args = *static_cast<monitor_args_t *>(args);
 
-        total_scores[data.id][data.topic] += data.score;
-        pthread_mutex_unlock(&total_scores_lock);
+    int hot_samples = 0, cold_samples = 0;
+    auto last_sample = now_ns();
+
+    while (!mapper_done) {
+        usleep(MONITOR_INTERVAL_US);
+
+        const auto now = now_ns();
+        const auto interval_ns = now - last_sample;
+        last_sample = now;
+
+        // Only the monitor changes active_reducers, so it can read it
+        // without the lock.
+        const auto num_active = active_reducers;
+
+        size_t total_depth = 0;
+        long long total_stall_ns = 0;
+
+        for (size_t i = 0; i < num_active; i++) {
+            auto &r_con = thread_conns[i];
+
+            pthread_mutex_lock(&r_con.q_lock);
+            total_depth += r_con.q.size();
+            total_stall_ns += r_con.stall_ns;
+            r_con.stall_ns = 0;
+            pthread_mutex_unlock(&r_con.q_lock);
+        }
+
+        // Hot: queues are mostly full, or mappers spent over half of the
+        // interval waiting. Cold: queues are nearly empty and nobody waited.
+        const auto capacity = num_active * monitor_args.buf_size;
+        const bool hot =
+            4 * total_depth >= 3 * capacity || 2 * total_stall_ns > interval_ns;
+        const bool cold = 8 * total_depth <= capacity && total_stall_ns == 0;
+
+        hot_samples = hot ? hot_samples + 1 : 0;
+        cold_samples = cold ? cold_samples + 1 : 0;
+
+        if (hot_samples >= GROW_AFTER_SAMPLES &&
+            num_active < monitor_args.max_reducers) {
+            start_reducer(thread_conns[num_active]);
+
+            pthread_rwlock_wrlock(&active_reducers_lock);
+            active_reducers++;
+            pthread_rwlock_unlock(&active_reducers_lock);
 
 #ifdef DEBUG
-        COUT_SYNC("[r " << pthread_self()
-                        << "] Updated total scores. Restarting...\n")
+            COUT_SYNC("[monitor] queues full, growing to " << num_active + 1
+                                                           << " reducers\n")
 #endif
+            hot_samples = 0;
+        } else if (cold_samples >= SHRINK_AFTER_SAMPLES &&
+                   num_active > monitor_args.min_reducers) {
+            pthread_rwlock_wrlock(&active_reducers_lock);
+            active_reducers--;
+            pthread_rwlock_unlock(&active_reducers_lock);
+
+            // Nothing can be pushed to it anymore. Let it drain and exit.
+            auto &r_con = thread_conns[num_active - 1];
+            pthread_mutex_lock(&r_con.q_lock);
+            r_con.retiring = true;
+            pthread_cond_signal(&r_con.q_empty_cond);
+            pthread_mutex_unlock(&r_con.q_lock);
 
-    }  // end of while(true)
+#ifdef DEBUG
+            COUT_SYNC("[monitor] queues idle, shrinking to "
+                      << num_active - 1 << " reducers\n")
+#endif
+            cold_samples = 0;
+        }
+    }
+
+    return nullptr;
+}
+
+// Next merge bucket to be claimed by a merge worker.
+std::atomic<size_t> next_merge_bucket(0);
+
+// Formatted output of each merged bucket, written out in bucket order.
+std::vector<string> bucket_output(NUM_MERGE_BUCKETS);
+
+/**
+ * @brief Fold one partial score table into another.
+ * @param dst Table to add into.
+ * @param src Table to take from. It is left in an unspecified state.
+ */
+void merge_score_tables(score_table &dst, score_table &src) {
+    // Always walk the smaller table.
+    if (dst.size() < src.size()) dst.swap(src);
+
+    dst.merge(src);
+    src.clear();
+}
+
+/**
+ * @brief merge worker. Claims merge buckets one at a time, reduces that bucket
+ * across all reducers' partial tables pairwise in a tree, and formats the
+ * result.
+ * @return void* (unused, void* is here for the pthread create interface.)
+ */
+void *merge_worker(void *) {
+    size_t b;
+    while ((b = next_merge_bucket++) < NUM_MERGE_BUCKETS) {
+        // Tree reduction: after the round with a given stride, partial table i
+        // holds the sum of tables [i, i + 2 * stride).
+        const auto num_parts = thread_conns.size();
+        for (size_t stride = 1; stride < num_parts; stride *= 2) {
+            for (size_t i = 0; i + stride < num_parts; i += 2 * stride) {
+                merge_score_tables(thread_conns[i].total_scores[b],
+                                   thread_conns[i + stride].total_scores[b]);
+            }
+        }
+
+        auto &out = bucket_output[b];
+        thread_conns[0].total_scores[b].for_each(
+            [&out](score_table::key_type key, score_type tot_score) {
+                out += "(" + user_ids.name(score_table::key_user(key)) + ", " +
+                       topic_ids.name(score_table::key_topic(key)) + ", " +
+                       std::to_string(tot_score) + ")\n";
+            });
+    }
 
     return nullptr;
 }
 
 int main(int argc, char *argv[]) {
-    // Ensure user input 2 CLI args
-    if (argc != 3) {
-        std::cout << "Usage: combiner <no. slots> <no. reducer threads>\n";
+    const auto usage =
+        "Usage: main [--mappers=N] [--min-reducers=N] [--max-reducers=N] "
+        "[--actions=A,...] [--users=ID,...] [--topics=TOPIC,...] "
+        "[--segments=FILE] "
+        "<no. slots> <no. reducer threads> [input files or directories...]\n";
+
+    long num_mappers_arg = 0;
+    long min_reducers_arg = 0, max_reducers_arg = 0;
+
+    const option long_options[] = {
+        {"mappers", required_argument, NULL, 'm'},
+        {"min-reducers", required_argument, NULL, 'l'},
+        {"max-reducers", required_argument, NULL, 'h'},
+        {"actions", required_argument, NULL, 'a'},
+        {"users", required_argument, NULL, 'u'},
+        {"topics", required_argument, NULL, 't'},
+        {"segments", required_argument, NULL, 's'},
+        {NULL, 0, NULL, 0}};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "m:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'm':
+                num_mappers_arg = std::atol(optarg);
+                break;
+            case 'l':
+                min_reducers_arg = std::atol(optarg);
+                break;
+            case 'h':
+                max_reducers_arg = std::atol(optarg);
+                break;
+            case 'a':
+                record_filter.filter_actions = true;
+                for (const auto &action : split_list(optarg)) {
+                    if (!action_points.count(action)) {
+                        std::cout << "ERROR: Unknown action \"" << action
+                                  << "\" in --actions.\n";
+                        exit(EXIT_FAILURE);
+                    }
+                    record_filter.actions[(unsigned char)action[0]] = true;
+                }
+                break;
+            case 'u':
+                record_filter.filter_users = true;
+                for (const auto &user : split_list(optarg)) {
+                    record_filter.users.insert(user);
+                }
+                break;
+            case 't':
+                record_filter.filter_topics = true;
+                for (const auto &topic : split_list(optarg)) {
+                    record_filter.topics.emplace(topic, topic_ids.intern(topic));
+                }
+                break;
+            case 's':
+                load_segments(optarg);
+                break;
+            default:
+                std::cout << usage;
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    // Ensure user input at least 2 positional CLI args
+    if (argc - optind < 2) {
+        std::cout << usage;
         exit(EXIT_FAILURE);
     }
 
     // Get number of buffer slots & number of reducer workers from CLI args
-    const size_t BUF_SIZE = std::stoi(argv[1]);
-    const int NUM_USERS = std::stoi(argv[2]);
+    const size_t BUF_SIZE = std::stoi(argv[optind]);
+    const int NUM_REDUCERS = std::stoi(argv[optind + 1]);
 
     // Ensure valid CLI args
     if (BUF_SIZE == 0) {
@@ -426,46 +873,108 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    if (NUM_USERS < 1) {
-        std::cout << "ERROR: NUM_USERS must be at least 1.\n";
+    if (NUM_REDUCERS < 1) {
+        std::cout << "ERROR: NUM_REDUCERS must be at least 1.\n";
+        exit(EXIT_FAILURE);
+    }
+
+    // Without bounds, the reducer count stays fixed.
+    const size_t MIN_REDUCERS =
+        min_reducers_arg > 0 ? min_reducers_arg : NUM_REDUCERS;
+    const size_t MAX_REDUCERS =
+        max_reducers_arg > 0 ? max_reducers_arg : NUM_REDUCERS;
+
+    if (MIN_REDUCERS > (size_t)NUM_REDUCERS ||
+        MAX_REDUCERS < (size_t)NUM_REDUCERS) {
+        std::cout << "ERROR: Need --min-reducers <= NUM_REDUCERS <= "
+                     "--max-reducers.\n";
+        exit(EXIT_FAILURE);
+    }
+
+    // Everything after the two numbers is input. With none, read stdin.
+    input_paths = expand_input_paths(argv + optind + 2, argc - optind - 2);
+    if (argc - optind == 2) input_paths.push_back("-");
+
+    if (input_paths.empty()) {
+        std::cout << "ERROR: No input files found.\n";
         exit(EXIT_FAILURE);
     }
 
+    // One mapper per file by default, but no more than there are cores.
+    size_t num_mappers = num_mappers_arg > 0
+                             ? num_mappers_arg
+                             : std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+    num_mappers = std::min(num_mappers, input_paths.size());
+
 #ifdef DEBUG
     // Print CLI args
     std::cout << "Args: buffer size =" << BUF_SIZE
-              << ", number of user threads =" << NUM_USERS << "\n";
+              << ", number of reducer threads =" << NUM_REDUCERS << " ("
+              << MIN_REDUCERS << " to " << MAX_REDUCERS << ")"
+              << ", number of mapper threads =" << num_mappers
+              << ", number of input files =" << input_paths.size() << "\n";
 #endif
 
     // Iniitalize mutexes
-    pthread_mutex_init(&total_scores_lock, NULL);
-    pthread_mutex_init(&thread_conns_lock, NULL);
+    pthread_mutex_init(&input_paths_lock, NULL);
+    pthread_mutex_init(&mappers_running_lock, NULL);
+
+    // Prefer the writer so the monitor isn't starved by busy mappers.
+    pthread_rwlockattr_t rwlock_attr;
+    pthread_rwlockattr_init(&rwlock_attr);
+    pthread_rwlockattr_setkind_np(
+        &rwlock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&active_reducers_lock, &rwlock_attr);
+    pthread_rwlockattr_destroy(&rwlock_attr);
 
 #ifdef DEBUG
     pthread_mutex_init(&cout_lock, NULL);
 #endif
 
-    // Read text file
-    const auto text = readTextFile();
+    // Create the reducer pool up front, with room to grow. Mappers hash IDs
+    // onto the active part of it.
+    thread_conns = std::vector<ReducerConnection>(MAX_REDUCERS);
+    active_reducers = NUM_REDUCERS;
+
+    for (size_t i = 0; i < active_reducers; i++) {
+        start_reducer(thread_conns[i]);
+    }
+
+    // Only watch the queues if the reducer count may change.
+    monitor_args_t monitor_args = {BUF_SIZE, MIN_REDUCERS, MAX_REDUCERS};
+    pthread_t monitor_thread;
+    const bool elastic = MIN_REDUCERS != MAX_REDUCERS;
+
+    if (elastic) {
+        pthread_create(&monitor_thread, NULL, monitor_worker, &monitor_args);
+    }
 
-    // Struct to send text + BUF_SIZE to mapper thread
-    mapper_args_t mapper_args = {BUF_SIZE, text};
+    // Struct to send BUF_SIZE to mapper threads
+    mapper_args_t mapper_args = {BUF_SIZE};
 
-    // Create mapper thread
-    // (reducers will be created dynamically by mapper)
-    pthread_t mapper_thread;
+    // Create mapper threads
+    std::vector<pthread_t> mapper_threads(num_mappers);
+    mappers_running = num_mappers;
 
-    pthread_create(&mapper_thread, NULL, mapper_worker, &mapper_args);
+    for (auto &m_thread : mapper_threads) {
+        pthread_create(&m_thread, NULL, mapper_worker, &mapper_args);
+    }
 
     // Join threads
-    pthread_join(mapper_thread, NULL);
+    for (auto &m_thread : mapper_threads) {
+        pthread_join(m_thread, NULL);
+    }
 
 #ifdef DEBUG
-    COUT_SYNC("[main] mapper joined. Joining reducers...\n");
+    COUT_SYNC("[main] mappers joined. Joining reducers...\n");
 #endif
 
-    for (auto &r_thread : reducer_workers) {
-        pthread_join(r_thread, NULL);
+    // The monitor stops once the mappers are done. After that, no reducer
+    // is started or retired.
+    if (elastic) pthread_join(monitor_thread, NULL);
+
+    for (auto &r_con : thread_conns) {
+        if (r_con.running) pthread_join(r_con.thread, NULL);
     }
 
 #ifdef DEBUG
@@ -478,16 +987,24 @@ int main(int argc, char *argv[]) {
     std::cout << "--------------------------------------------------\n";
 #endif
 
+    // Merge the partial tables, one merge worker per possible reducer.
+    std::vector<pthread_t> merge_threads(thread_conns.size());
+
+    for (auto &merge_thread : merge_threads) {
+        pthread_create(&merge_thread, NULL, merge_worker, NULL);
+    }
+
+    for (auto &merge_thread : merge_threads) {
+        pthread_join(merge_thread, NULL);
+    }
+
+#ifdef DEBUG
+    COUT_SYNC("[main] All merge workers joined.\n");
+#endif
+
     // Print final results
-    for (auto &id_map : total_scores) {
-        const auto id = id_map.first;
-
-        for (auto &topic_map : id_map.second) {
-            const auto topic = topic_map.first;
-            const auto tot_score = topic_map.second;
-            std::cout << "(" << id << ", " << topic << ", " << tot_score
-                      << ")\n";
-        }
+    for (auto &out : bucket_output) {
+        fwrite(out.data(), 1, out.size(), stdout);
     }
 
     // Destroy all resources used.
@@ -496,11 +1013,9 @@ int main(int argc, char *argv[]) {
 #endif
 
     // Destroy mutexes
-    pthread_mutex_destroy(&total_scores_lock);
-    pthread_mutex_destroy(&thread_conns_lock);
-
-    // Free input text
-    free(text);
+    pthread_mutex_destroy(&input_paths_lock);
+    pthread_mutex_destroy(&mappers_running_lock);
+    pthread_rwlock_destroy(&active_reducers_lock);
 
     return 0;
 }
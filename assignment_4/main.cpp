@@ -1,17 +1,27 @@
-#include <semaphore.h>
+#include <linux/futex.h>
 #include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #include <wait.h>
 
-#include <array>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
 #include <iostream>
 #include <regex>
 #include <string>
 #include <unordered_map>
 #include <vector>
-using std::array;
+
+#include "flat_score_table.hpp"
 using std::string;
 using std::unordered_map;
 
@@ -35,134 +45,392 @@ using score_t = int;
 /**
  * @brief Tuple to hold score adjustments per topic for an ID.
  * Mapper will send this info to the reducer designated for this action's ID.
+ *
+ * The ID and topic are interned in the shared region, so an action is only
+ * 8 bytes. Every action's score fits in 8 bits.
  */
 struct mapped_action {
-    char topic[50];
-    score_t score_adjustment;
-    bool done = false;
+    static const uint32_t DONE = UINT32_MAX;  // user of the "done" signal
+
+    uint32_t user;                 // Number in shared_region_t::users
+    uint32_t topic : 24;           // Number in shared_region_t::topics
+    score_t score_adjustment : 8;
 };
+static_assert(sizeof(mapped_action) == 8);
+
+/**
+ * @brief Block while *addr == expected, until woken by futex_wake() or for
+ * at most timeout, if it isn't null. The futexes live in memory shared
+ * between processes, so they aren't private.
+ * @return Whether the wait timed out.
+ */
+bool futex_wait(std::atomic<uint32_t> *addr, uint32_t expected,
+                const timespec *timeout = nullptr) {
+    return syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), FUTEX_WAIT,
+                   expected, timeout, nullptr, 0) == -1 &&
+           errno == ETIMEDOUT;
+}
 
 /**
- * @brief Data structure the mmapped region will be cast to.
+ * @brief Wake every process blocked in futex_wait() on addr.
+ */
+void futex_wake(std::atomic<uint32_t> *addr) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), FUTEX_WAKE,
+            INT32_MAX, nullptr, nullptr, 0);
+}
+
+// Atomics are shared between processes, which only works if they are
+// lock-free.
+static_assert(std::atomic<uint32_t>::is_always_lock_free);
+static_assert(std::atomic<size_t>::is_always_lock_free);
+
+/**
+ * @brief Data structure at the start of the mmapped region.
  * Use this to conveniently access members in the shared region.
+ *
+ * The region is sized for one run: the queues, tables and results are
+ * arrays after this header, laid out by layout(). The region is mapped
+ * before fork()ing, so the pointers to them are valid in every process.
  */
 class shared_region_t {
-    static const auto SEM_PSHARED = 1;
+    static const size_t CACHE_LINE = 64;
+
+    /**
+     * @brief Hands out cache-line-aligned arrays after the header, in
+     * order. With base 0, it only measures how big the region must be.
+     */
+    struct region_layout {
+        uintptr_t base;
+        size_t used = sizeof(shared_region_t);
+
+        template <typename T>
+        T *take(size_t count) {
+            used = (used + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+            auto *array = reinterpret_cast<T *>(base + used);
+            used += count * sizeof(T);
+            return array;
+        }
+    };
+
 public:
     /**
-     * @brief IPC Queue object.
+     * @brief How much the region must hold.
+     */
+    struct sizes_t {
+        size_t num_queues;
+        size_t queue_size;    // Entries per queue
+        size_t max_users;
+        size_t userid_chars;  // Total size of every ID, '\0's included
+        size_t max_topics;
+        size_t topic_chars;   // Total size of every topic, '\0's included
+        size_t max_results;
+    };
+
+    /**
+     * @brief IPC Queue object: a ring with a single writer (the mapper) and a
+     * single reader (a reducer).
+     *
+     * head and tail count every entry ever read and written, and wrap around
+     * at 2^32; an entry's slot is its count % capacity. Each side only writes
+     * its own index, on its own cache line. When the ring is full, the writer
+     * sleeps on a futex on head until the reader moves it, and when it is
+     * empty, the reader sleeps on tail. A side only makes the wake-up system
+     * call if the other has said it is waiting.
      */
     class queue {
-        int MAX_SIZE;
     public:
-        static const size_t NUM_ENTRIES = 100;
-        array<mapped_action, NUM_ENTRIES> data;  // From mapper
-        sem_t lock, size;
-        // Used to keep track of valid data in the queue.
-        mapped_action *head, *tail; 
+        static const size_t MAX_ENTRIES = 1 << 20;
 
+    private:
+        // Reader's side
+        alignas(CACHE_LINE) std::atomic<uint32_t> head;
+        std::atomic<uint32_t> reader_waiting;
+
+        // Writer's side
+        alignas(CACHE_LINE) std::atomic<uint32_t> tail;
+        std::atomic<uint32_t> writer_waiting;
+
+        alignas(CACHE_LINE) uint32_t capacity;
+        mapped_action *data;  // From mapper
+        pid_t reader;         // The reducer, once it is fork()ed
+
+        // How long the writer sleeps on a full queue before it checks that
+        // the reader is still alive.
+        static constexpr timespec READER_CHECK_INTERVAL = {0, 100000000};
+
+        /**
+         * @brief Whether the reader has exited. It is left to be reaped.
+         */
+        bool reader_exited() const {
+            siginfo_t info{};
+            return waitid(P_PID, reader, &info,
+                          WEXITED | WNOHANG | WNOWAIT) == 0 &&
+                   info.si_pid == reader;
+        }
+
+    public:
         /**
          * @brief Initialize queue for IPC.
+         * @param entries Where the queue's entries are kept.
+         * @param max_q_size Number of entries, at most MAX_ENTRIES.
          */
-        void init(int max_q_size) {
-            sem_init(&lock, SEM_PSHARED, 1);  // Mutex
-            sem_init(&size, SEM_PSHARED, 0);  // Size of queue
-            
-            head = tail = &data[0];
-            MAX_SIZE = max_q_size;
+        void init(mapped_action *entries, uint32_t max_q_size) {
+            head = tail = 0;
+            reader_waiting = writer_waiting = 0;
+            capacity = max_q_size;
+            data = entries;
+            reader = 0;
         }
 
         /**
-         * @brief Clean up queue.
+         * @brief Set the reducer that reads this queue.
          */
-        void destroy() {
-            sem_destroy(&lock);
-            sem_destroy(&size);
+        void set_reader(pid_t pid) { reader = pid; }
+
+        /**
+         * @brief Number of entries written but not read yet.
+         */
+        uint32_t size() const {
+            return tail.load(std::memory_order_acquire) -
+                   head.load(std::memory_order_acquire);
         }
 
         /**
-         * @brief Write to the back of the queue.
-         * @param data mapped_action obj to write.
+         * @brief Write to the back of the queue, waiting for room if it is
+         * full. Exits with an error if the reader dies while the queue is
+         * full, as nothing would ever make room.
+         * @param entry mapped_action obj to write.
          */
-        void write(mapped_action data) {
-            sem_wait(&lock);
-            
-            int curr_size;
-            sem_getvalue(&size, &curr_size);
-
-            if(curr_size == MAX_SIZE) {
-                printf("ERROR: Buffer is full!\n");
-                exit(EXIT_FAILURE);
-            }
-            else {
-                *tail = data; // TODO verify this works with char*s (it won't)
-                
-                // Increment tail pointer
-                if(tail == &this->data[MAX_SIZE-1]) {
-                    tail = &this->data[0];
+        void write(const mapped_action &entry) {
+            const uint32_t t = tail.load(std::memory_order_relaxed);
+
+            uint32_t h;
+            while (t - (h = head.load(std::memory_order_acquire)) == capacity) {
+                // Say we're waiting before looking at head one last time, so
+                // that either we see the reader's progress or it sees us.
+                writer_waiting.store(1);
+                if (head.load() == h &&
+                    futex_wait(&head, h, &READER_CHECK_INTERVAL) &&
+                    reader_exited()) {
+                    printf("ERROR: A reducer failed.\n");
+                    exit(EXIT_FAILURE);
                 }
-                else tail++;
+                writer_waiting.store(0, std::memory_order_relaxed);
             }
-            
-            sem_post(&size);
-            sem_post(&lock);
+
+            data[t % capacity] = entry;
+            tail.store(t + 1);
+
+            if (reader_waiting.load()) futex_wake(&tail);
         }
 
         /**
-         * @brief Read from the head of the queue.
-         * 
-         * @return mapped_action 
+         * @brief Read from the head of the queue, waiting for an entry if it
+         * is empty.
+         *
+         * @return mapped_action
          */
         mapped_action read() {
-            sem_wait(&size);
-            sem_wait(&lock);
-
-            auto data = *head;
+            const uint32_t h = head.load(std::memory_order_relaxed);
 
-            // Incremenet head pointer
-            if(head == &this->data[MAX_SIZE-1])
-                head = &this->data[0];
-            else
-                head++;
+            uint32_t t;
+            while ((t = tail.load(std::memory_order_acquire)) == h) {
+                reader_waiting.store(1);
+                if (tail.load() == t) futex_wait(&tail, t);
+                reader_waiting.store(0, std::memory_order_relaxed);
+            }
 
-            sem_post(&lock);
-            
             // Return a copy (since this slot may be overwritten now)
-            return data;
+            const auto entry = data[h % capacity];
+            head.store(h + 1);
+
+            if (writer_waiting.load()) futex_wake(&head);
+
+            return entry;
         }
+
+        /**
+         * @brief Number of slots, for debugging.
+         */
+        uint32_t slots() const { return capacity; }
+
+        /**
+         * @brief Entry in slot i, for debugging.
+         */
+        const mapped_action &slot(size_t i) const { return data[i]; }
     };  // end of queue
 
-    static const size_t MAX_REDUCERS = 20;
-    array<queue, MAX_REDUCERS> queues;
+    /**
+     * @brief Append-only set of strings, e.g. every user ID seen so far.
+     * Strings are numbered in the order they are added, and actions name
+     * them by number. chars holds them back to back, each ending with '\0',
+     * and offsets[i] is where string i starts. A string is written before
+     * any action names it, and never changes.
+     *
+     * index is an open-addressing hash index of the strings, with linear
+     * probing: each slot holds a string's number + 1, or 0 if it is empty.
+     * It has at least twice as many slots as there can be strings, so it is
+     * at most half full.
+     *
+     * Only the mapper adds strings, so lookups need no lock.
+     */
+    class string_table {
+        const char *what;  // What the strings are, for errors
+        size_t max_size;
+        size_t max_chars;
+        size_t index_slots;  // A power of 2
+        uint32_t *offsets;
+        char *chars;
+        uint32_t *index;
+        size_t size_;
+        size_t chars_size;
+
+    public:
+        /**
+         * @brief Lay the table out in the region. It starts out empty, as
+         * new pages are zeroed.
+         * @param max_chars Total size of every string, '\0's included. At
+         * most 4 GiB.
+         */
+        void layout(region_layout &region, const char *what, size_t max_size,
+                    size_t max_chars) {
+            this->what = what;
+            this->max_size = max_size;
+            this->max_chars = max_chars;
+            for (index_slots = 1; index_slots < 2 * max_size;) index_slots *= 2;
+            offsets = region.take<uint32_t>(max_size);
+            chars = region.take<char>(max_chars);
+            index = region.take<uint32_t>(index_slots);
+            size_ = chars_size = 0;
+        }
+
+        /**
+         * @brief Find a string's number, adding it if it is new.
+         * @param str The string.
+         * @param str_hash Hash of str.
+         */
+        uint32_t find_or_add(const string &str, size_t str_hash) {
+            const size_t mask = index_slots - 1;
+            size_t slot = str_hash & mask;
+            for (; index[slot] != 0; slot = (slot + 1) & mask) {
+                const auto i = index[slot] - 1;
+                if (str == (*this)[i]) return i;
+            }
+
+            // It wasn't in the table. Add it
+            if (size_ == max_size ||
+                chars_size + str.size() + 1 > max_chars) {
+                printf("ERROR: More than %zu %s.\n", max_size, what);
+                exit(EXIT_FAILURE);
+            }
+
+            memcpy(&chars[chars_size], str.c_str(), str.size() + 1);
+            offsets[size_] = chars_size;
+            chars_size += str.size() + 1;
+
+            index[slot] = size_ + 1;
+            return size_++;
+        }
+
+        const char *operator[](uint32_t i) const {
+            return &chars[offsets[i]];
+        }
+    };  // end of string_table
+
+    static const size_t MAX_REDUCERS = 64;
+    size_t num_queues;
+    queue *queues;  // One per reducer
+    mapped_action *queue_entries;
+
+    string_table users;   // Every user ID seen so far
+    static constexpr size_t MAX_TOPICS = 1 << 24;  // Must fit in 24 bits
+    string_table topics;  // Every topic seen so far
 
     /**
-     * @brief A convenient way for reducers to obtain their userid.
-     * Reducers have an index associated with them. userids[index] is
-     * their userid in string form.
-     * WARNING: Be sure to strcpy() into this array,
-     * or it won't be saved in shared memory.
+     * @brief A final (user, topic) score from a reducer.
      */
-    array<char[50], MAX_REDUCERS> userids;
-    size_t userids_size = 0;
-    sem_t userids_lock; // Mutex for userids array. TODO necessary?
+    struct result_t {
+        uint32_t user;
+        uint32_t topic;
+        score_t score;
+    };
+
+    /**
+     * @brief Every reducer's results. Each reducer claims one contiguous
+     * segment for all of its results once it is done, and the parent prints
+     * them all after the reducers exit.
+     */
+    size_t max_results;
+    result_t *results;
+    std::atomic<size_t> results_size;
+
+    size_t mapped_size;  // Size of the whole mapping
+
+private:
     /**
-     * @brief Initialize all IPC queues.
+     * @brief Set the pointers to every array, and return the region's size.
      */
-    void init(int max_q_size) {
-        for (auto &q : queues) q.init(max_q_size);
+    size_t layout(uintptr_t base, const sizes_t &sizes) {
+        region_layout region{base};
 
-        sem_init(&userids_lock, SEM_PSHARED, 1);
+        num_queues = sizes.num_queues;
+        queues = region.take<queue>(num_queues);
+        queue_entries = region.take<mapped_action>(
+            num_queues * queue_stride(sizes.queue_size));
+
+        users.layout(region, "users", sizes.max_users, sizes.userid_chars);
+        topics.layout(region, "topics", sizes.max_topics, sizes.topic_chars);
+
+        max_results = sizes.max_results;
+        results = region.take<result_t>(max_results);
+
+        return region.used;
     }
 
     /**
-     * @brief Destory all queues.
+     * @brief Entries from one queue's first to the next's. Queues start on
+     * their own cache lines.
      */
-    void destroy() {
-        for (auto &q : queues) q.destroy();
+    static size_t queue_stride(size_t queue_size) {
+        const auto per_line = CACHE_LINE / sizeof(mapped_action);
+        return (queue_size + per_line - 1) / per_line * per_line;
+    }
 
-        sem_destroy(&userids_lock);
+public:
+    /**
+     * @brief Bytes needed for a region of these sizes.
+     */
+    static size_t size_for(const sizes_t &sizes) {
+        shared_region_t measure;
+        return measure.layout(0, sizes);
+    }
+
+    /**
+     * @brief Initialize a new region, mapped at this, and all IPC queues.
+     * @param mapped_size Size of the mapping, at least size_for(sizes).
+     */
+    void init(const sizes_t &sizes, size_t mapped_size) {
+        layout(reinterpret_cast<uintptr_t>(this), sizes);
+
+        const auto stride = queue_stride(sizes.queue_size);
+        for (size_t i = 0; i < num_queues; i++)
+            queues[i].init(&queue_entries[i * stride], sizes.queue_size);
+
+        results_size = 0;
+        this->mapped_size = mapped_size;
     }
 
+    /**
+     * @brief Claim a segment of count results for a reducer.
+     */
+    result_t *claim_results(size_t count) {
+        const auto start = results_size.fetch_add(count);
+        if (start + count > max_results) {
+            printf("ERROR: Too many results.\n");
+            exit(EXIT_FAILURE);
+        }
+        return &results[start];
+    }
 };  // end of mmapped_region_t
 
 /**
@@ -200,11 +468,21 @@ struct input_data_t {
                           // consider stripping it
 };
 
+// Map that coorelates an action to its cooresponding point value.
+const unordered_map<string, score_t> action_points{
+    {"P", 50}, {"L", 20}, {"D", -10}, {"C", 30}, {"S", 40}};
+
 /**
- * @brief Parse tokens into actions.
+ * @brief Parse tokens into actions. Exits with an error if the last tuple is
+ * incomplete or an action is unknown, before any child is forked.
  * @param tokens
  */
 std::vector<input_data_t> parse_actions(const std::vector<string> &tokens) {
+    if (tokens.size() % 3 != 0) {
+        printf("ERROR: Input ends in an incomplete tuple.\n");
+        exit(EXIT_FAILURE);
+    }
+
     std::vector<input_data_t> actions;
 
     // Iterate through the tokens and produce action tuples.
@@ -213,66 +491,41 @@ std::vector<input_data_t> parse_actions(const std::vector<string> &tokens) {
         actions.push_back(
             // TODO Does this copy into input_data_t? I think it does
             input_data_t{*it++, *it++, *it++});
+
+        if (action_points.count(actions.back().action) == 0) {
+            printf("ERROR: Unknown action \"%s\".\n",
+                   actions.back().action.c_str());
+            exit(EXIT_FAILURE);
+        }
     }
 
     return actions;
 }
 
-void fork_it_up(shared_region_t *mapped_region, int index, int num_reducers);
-
 /**
  * @brief Mapper process
- * @param tokens vector of strings from stdin.
+ * @param actions Parsed tuples from stdin.
  * @param shared_mem Pointer to shared region
  */
-void mapper(const std::vector<string> &tokens, shared_region_t *shared_mem, int num_reducers) {
+void mapper(const std::vector<input_data_t> &actions, shared_region_t *shared_mem, int num_reducers) {
     DP("[m] Starting mapper...")
 
     // Used to convert userid_t to an index, in the mmapped array.
     // static std::vector<userid_t> id_index;
 
-    const auto actions = parse_actions(tokens);
-
-    // Map that coorelates an action to its cooresponding point value.
-    const unordered_map<string, score_t> action_points{
-        {"P", 50}, {"L", 20}, {"D", -10}, {"C", 30}, {"S", 40}};
-
     // Next, send the mapped data to the reducer, action by action.
     for (auto &action : actions) {
-        sem_wait(&shared_mem->userids_lock);
-        // Get the index corresponding to this ID.
-        const auto iter =
-            // std::find(id_index.begin(), id_index.end(), action.id);
-            std::find(shared_mem->userids.begin(), shared_mem->userids.end(), action.id); // TODO ensure this works since action.id is a string, not char*
-
-        // Index used to push the data to the reducer.
-        int index;
-        if (iter == shared_mem->userids.end()) {
-            // It wasn't in the array. Add it
-            strcpy(
-                shared_mem->userids[shared_mem->userids_size], 
-                action.id.c_str()
-            );
-            
-            index = shared_mem->userids_size++;
-            
-            // Make a new reducer process to handle this data.
-            DP("[m] Forking...")
-            fork_it_up(shared_mem, index, num_reducers);
-
-        } else {
-            // Get the index this element is at in the vector.
-            index = std::distance(shared_mem->userids.begin(), iter);
-        }
-
-        sem_post(&shared_mem->userids_lock);
-
-        // Get reference to this index's queue
+        // Every action for a user goes to the same reducer.
+        const auto id_hash = std::hash<userid_t>{}(action.id);
+        const auto user = shared_mem->users.find_or_add(action.id, id_hash);
+        const auto index = id_hash % num_reducers;
         auto& queue = shared_mem->queues[index];
 
         // Create score object to be shared with reducer process
         mapped_action score;
-        strcpy(score.topic, action.topic.c_str());
+        score.user = user;
+        score.topic = shared_mem->topics.find_or_add(
+            action.topic, std::hash<topic_t>{}(action.topic));
         // convert action to points
         score.score_adjustment = action_points.at(action.action);
 
@@ -284,13 +537,9 @@ void mapper(const std::vector<string> &tokens, shared_region_t *shared_mem, int
 
     // All data has been sent to all reducers.
     // Now, append a "done" signal to each reducer queue.
-    for(unsigned i = 0; i < shared_mem->userids_size; i++) {
+    for(int i = 0; i < num_reducers; i++) {
         auto &queue = shared_mem->queues[i];
-        queue.write(mapped_action {
-            "",
-            0,
-            true
-        });
+        queue.write(mapped_action {mapped_action::DONE, 0, 0});
         
         DP("[m] Sent \"done\" to reducer at index" << i)
     }
@@ -304,18 +553,16 @@ void mapper(const std::vector<string> &tokens, shared_region_t *shared_mem, int
  */
 void dump_shared_region(shared_region_t *shared_mem) {
     printf("--dump_shared_region()----------\n");
-    for(unsigned i = 0; i < shared_mem->queues.size(); i++) {
+    for(unsigned i = 0; i < shared_mem->num_queues; i++) {
         auto& q = shared_mem->queues[i];
-        const auto& id = shared_mem->userids[i];
 
-        int q_size;
-        sem_getvalue(&q.size, &q_size);
-        
-        printf("ID \"%s\": {", id);
-        
-        for(auto& e: q.data) {
-            if(!e.done)
-                printf("{\"%s\", %d}, ", e.topic, e.score_adjustment);
+        printf("Queue %u: %u queued {", i, q.size());
+
+        for (size_t j = 0; j < q.slots(); j++) {
+            const auto &e = q.slot(j);
+            if(e.user != mapped_action::DONE)
+                printf("{\"%s\", \"%s\", %d}, ", shared_mem->users[e.user],
+                       shared_mem->topics[e.topic], e.score_adjustment);
             else 
                 printf("{DONE},");
         }
@@ -331,54 +578,100 @@ void dump_shared_region(shared_region_t *shared_mem) {
  * @brief Reducer worker.
  * Run after fork()ing.
  * @param mapped_data Pointer to shared memory
- * @param id Which index of the data array (AKA ID)
- * this reducer should work on.
+ * @param index Which queue this reducer reads. It gets every action of the
+ * users that hash to it.
  */
 void reducer(shared_region_t *shared_mem, int index) {
-    sem_wait(&shared_mem->userids_lock);
-    const auto userid = shared_mem->userids[index];
-    sem_post(&shared_mem->userids_lock);
-
-    DP("[r " << userid << "] Reducer spun up")
+    DP("[r " << index << "] Reducer spun up")
 
-    // id -> (topic -> total score) for this ID
-    unordered_map<topic_t, score_t> total_scores;
+    // (user, topic) -> total score
+    flat_score_table total_scores;
 
     auto& queue = shared_mem->queues[index];
 
     while(true) {
         auto data = queue.read();
-        if(data.done) {
-            DP("[r " << userid << "] Received done from mapper.")
+        if(data.user == mapped_action::DONE) {
+            DP("[r " << index << "] Received done from mapper.")
             break;
         }
         
-        DP("[r " << userid << "] updating \"" << data.topic << "\"...")
-        
-        // This is okay, since operator[] will construct a default value if it
-        // doesn't exist. Nice!
-        total_scores[data.topic] += data.score_adjustment;
+        DP("[r " << index << "] updating \""
+           << shared_mem->topics[data.topic] << "\"...")
+
+        // add() will insert the key with a score of 0 if it doesn't exist.
+        total_scores.add(data.user, data.topic, data.score_adjustment);
     }
 
-    DP("r[ " << userid << "] total_scores.size() = " << total_scores.size())
+    DP("r[ " << index << "] total_scores.size() = " << total_scores.size())
+
+    auto *result = shared_mem->claim_results(total_scores.size());
+    total_scores.for_each([&](flat_score_table::key_type key, score_t score) {
+        *result++ = {flat_score_table::key_user(key),
+                     flat_score_table::key_topic(key), score};
+    });
 
-    for (auto &pair : total_scores) {  // Loop through userids
-        auto topic = pair.first;
-        auto score = pair.second;
-        printf("(%s,%s,%d)\n", userid, topic.c_str(), score);
+    DP("[r " << index << "] Done. Goodbye.")
+}
+
+/**
+ * @brief Map size bytes of a new memfd, with every page allocated up front,
+ * to be shared with the reducers.
+ *
+ * A region of a huge page or more uses huge pages if it can, so large queues
+ * and tables don't thrash the TLB: hugetlbfs pages if enough are reserved,
+ * or else transparent huge pages if the kernel allows them for shared
+ * memory.
+ * @param size Bytes needed. Set to the size of the mapping.
+ * @return The mapping, or MAP_FAILED.
+ */
+void *map_region(size_t &size) {
+    static const size_t HUGE_PAGE_SIZE = 2 << 20;
+
+    if (size >= HUGE_PAGE_SIZE) {
+        const int fd = memfd_create("a4", MFD_CLOEXEC | MFD_HUGETLB);
+        if (fd != -1) {
+            const auto huge_size =
+                (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+
+            // Fails if there aren't enough huge pages reserved.
+            void *region = MAP_FAILED;
+            if (ftruncate(fd, huge_size) == 0)
+                region = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, fd, 0);
+            close(fd);
+
+            if (region != MAP_FAILED) {
+                size = huge_size;
+                return region;
+            }
+        }
     }
 
-    DP("[r " << userid << "] Done. Goodbye.")
+    const int fd = memfd_create("a4", MFD_CLOEXEC);
+    if (fd == -1) return MAP_FAILED;
+
+    void *region = MAP_FAILED;
+    if (ftruncate(fd, size) == 0)
+        region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED) return region;
+
+    // Ask for huge pages before any are allocated, then allocate them all.
+    // Both are only hints: without them, pages are allocated on first use.
+    if (size >= HUGE_PAGE_SIZE) madvise(region, size, MADV_HUGEPAGE);
+    madvise(region, size, MADV_POPULATE_WRITE);
+
+    return region;
 }
 
 /**
  * @brief Initialize shared region.
  * @return shared_region_t*
  */
-shared_region_t *shared_region_init(int max_q_size) {
-    auto *shared_region = (shared_region_t *)mmap(
-        NULL, sizeof(shared_region_t), PROT_READ | PROT_WRITE,
-        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+shared_region_t *shared_region_init(const shared_region_t::sizes_t &sizes) {
+    auto size = shared_region_t::size_for(sizes);
+    auto *shared_region = (shared_region_t *)map_region(size);
 
     if (shared_region == MAP_FAILED) {
         printf("Error: Couldn't map memory region.\n");
@@ -386,33 +679,100 @@ shared_region_t *shared_region_init(int max_q_size) {
     }
 
     // Initialize shared region.
-    shared_region->init(max_q_size);
+    shared_region->init(sizes, size);
 
     return shared_region;
 }
 
 /**
- * @brief fork() once.
- * @param mapped_region
+ * @brief Work out how big the shared region must be for these actions.
+ * Every action could have a new user and topic, and add a result.
  */
-void fork_it_up(shared_region_t *mapped_region, int index, int num_reducers) {
-    static auto times_forked = 0;
-    
-    if(times_forked >= num_reducers) {
-        printf("ERROR: Ran out of processes! Run with a larger value of \"num_reducers\" to continue.\n");
+shared_region_t::sizes_t region_sizes(const std::vector<input_data_t> &actions,
+                                      size_t max_q_size, size_t num_reducers) {
+    shared_region_t::sizes_t sizes{};
+    const auto num_actions = actions.size();
+
+    sizes.num_queues = num_reducers;
+    // A queue never holds more than every action and a "done" signal.
+    sizes.queue_size = std::min(max_q_size, num_actions + 1);
+
+    sizes.max_users = num_actions;
+    sizes.max_topics = std::min(num_actions, shared_region_t::MAX_TOPICS);
+    sizes.max_results = num_actions;
+    for (const auto &action : actions) {
+        sizes.userid_chars += action.id.size() + 1;
+        sizes.topic_chars += action.topic.size() + 1;
+    }
+
+    // The tables keep where strings start in 32 bits.
+    if (sizes.userid_chars > UINT32_MAX || sizes.topic_chars > UINT32_MAX) {
+        printf("ERROR: Input is too large.\n");
         exit(EXIT_FAILURE);
     }
 
-    auto result = fork();
-    times_forked++;
+    return sizes;
+}
 
-    if (result == -1) {
-        printf("Error: fork() didn't work.\n");
+/**
+ * @brief Print every reducer's results to stdout with one write, sorted by
+ * user and then topic in the order they first appear in the input.
+ */
+void print_results(shared_region_t *shared_mem) {
+    auto *results = shared_mem->results;
+    auto *end = results + shared_mem->results_size.load();
+
+    std::sort(results, end, [](const auto &a, const auto &b) {
+        return a.user != b.user ? a.user < b.user : a.topic < b.topic;
+    });
+
+    // The mapper wrote every ID and topic before sending any of their
+    // actions.
+    string out;
+    for (const auto *r = results; r != end; r++) {
+        out += "(";
+        out += shared_mem->users[r->user];
+        out += ",";
+        out += shared_mem->topics[r->topic];
+        out += ",";
+        out += std::to_string(r->score);
+        out += ")\n";
+    }
+
+    if (fwrite(out.data(), 1, out.size(), stdout) != out.size() ||
+        fflush(stdout) == EOF) {
+        perror("write");
         exit(EXIT_FAILURE);
-    } else if (result == 0) {
-        // Child process
-        reducer(mapped_region, index); // Run the reducer.
-        exit(EXIT_SUCCESS); // Exit this process
+    }
+}
+
+/**
+ * @brief fork() a reducer for each queue.
+ * @param mapped_region
+ */
+void start_reducers(shared_region_t *mapped_region, int num_reducers) {
+    const auto parent = getpid();
+
+    for (int i = 0; i < num_reducers; i++) {
+        auto result = fork();
+
+        if (result == -1) {
+            printf("Error: fork() didn't work.\n");
+            exit(EXIT_FAILURE);
+        } else if (result == 0) {
+            // Child process. Die with the parent, which runs the mapper, so a
+            // failed mapper never leaves reducers waiting on their queues. The
+            // parent may already be gone by the time that is set up.
+            if (prctl(PR_SET_PDEATHSIG, SIGKILL) == -1 ||
+                getppid() != parent) {
+                _exit(EXIT_FAILURE);
+            }
+
+            reducer(mapped_region, i); // Run the reducer.
+            exit(EXIT_SUCCESS); // Exit this process
+        }
+
+        mapped_region->queues[i].set_reader(result);
     }
     // Parent process returns.
 }
@@ -428,6 +788,20 @@ int main(int argc, char *argv[]) {
     const auto max_q_size = std::stoi(argv[1]);
     const auto num_reducers = std::stoi(argv[2]);
 
+    if (max_q_size < 1 ||
+        max_q_size > (int)shared_region_t::queue::MAX_ENTRIES) {
+        printf("ERROR: <buffer size> must be between 1 and %zu.\n",
+               shared_region_t::queue::MAX_ENTRIES);
+        exit(EXIT_FAILURE);
+    }
+
+    if (num_reducers < 1 ||
+        num_reducers > (int)shared_region_t::MAX_REDUCERS) {
+        printf("ERROR: <no. reducers> must be between 1 and %zu.\n",
+               shared_region_t::MAX_REDUCERS);
+        exit(EXIT_FAILURE);
+    }
+
     const auto text = read_stdin();
 
     // delims are anything inside the []s
@@ -439,28 +813,41 @@ int main(int argc, char *argv[]) {
         if (e.find_first_not_of(' ') != string::npos) tokens.push_back(e);
     }
 
+    // Parse everything before any reducer is started, so bad input can't
+    // fail the mapper while they wait for it.
+    const auto actions = parse_actions(tokens);
+
     // Set up shared memory
-    auto shared_region = shared_region_init(max_q_size);
+    auto shared_region = shared_region_init(
+        region_sizes(actions, max_q_size, num_reducers));
 
     D(dump_shared_region(shared_region);)
 
+    // Flush stdout so the reducers don't inherit anything buffered.
+    fflush(stdout);
+    start_reducers(shared_region, num_reducers);
 
     // Now that all the reducers are spun up, run the mapper.
-    mapper(tokens, shared_region, num_reducers);
+    mapper(actions, shared_region, num_reducers);
 
     D(dump_shared_region(shared_region);)
 
     DP("Waiting for reducer procs to finish...")
 
+    // A reducer that failed never finished its results.
     for (int i = 0; i < num_reducers; i++) {
-        wait(NULL);
+        int status;
+        if (wait(&status) == -1 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != EXIT_SUCCESS) {
+            printf("ERROR: A reducer failed.\n");
+            exit(EXIT_FAILURE);
+        }
     }
 
-    // Destroy mutexes and semaphores.
-    shared_region->destroy();
+    print_results(shared_region);
 
     // Unmap shared memory
-    if (munmap(shared_region, sizeof(shared_region_t)) == -1) {
+    if (munmap(shared_region, shared_region->mapped_size) == -1) {
         printf("Error: Problem unmapping memory.\n");
         exit(EXIT_FAILURE);
     }
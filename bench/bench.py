@@ -0,0 +1,322 @@
+#!/usr/bin/env python3
+"""
+Runs every map/reduce implementation in the repo on the same generated
+workloads, checks that their outputs agree, and prints their throughput,
+latency and peak memory side by side.
+
+Usage: python3 bench/bench.py [--sizes N ...] [--skews S ...] [--repeat N]
+
+Build the implementations and bench/build/measure first (`make bench` at the
+top level does both).
+"""
+
+import argparse
+import os
+import random
+import re
+import select
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+from collections import namedtuple
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+MEASURE = os.path.join(ROOT, 'bench', 'build', 'measure')
+
+ACTIONS = {'P': 50, 'L': 20, 'D': -10, 'C': 30, 'S': 40}
+
+TOPICS = [
+    'history', 'art', 'sports', 'music', 'movies', 'cooking', 'travel',
+    'gaming', 'science', 'politics', 'fashion', 'cosmetics', 'photography',
+    'books', 'cars', 'fitness', 'finance', 'pets', 'gardening', 'comedy',
+    'entertainment', 'education', 'health', 'technology', 'weather',
+    'space', 'religion', 'parenting', 'crafts', 'dance', 'theatre', 'news',
+]
+
+# A variant is one command run on one workload file.
+#   cwd:         Directory to run in, relative to the repo root.
+#   cmd:         Shell command. {input} is the workload file.
+#   max_records: Largest workload the implementation can take, or None.
+#   max_users:   Most distinct users it can take, or None.
+#   input_txt:   The program only reads ./input.txt, so the workload is
+#                copied there and cwd is a scratch directory.
+Variant = namedtuple('Variant', 'name cwd cmd max_records max_users input_txt')
+
+VARIANTS = [
+    Variant('python', 'assignment_0_prelim',
+            'python3 mapper.py {input} | python3 reducer.py',
+            None, None, False),
+    # The preliminary C mapper keeps its tuples in a fixed array of 100.
+    Variant('c-prelim', None,
+            '{root}/assignment_0_prelim/build/mapper'
+            ' | {root}/assignment_0_prelim/build/reducer',
+            100, None, True),
+    Variant('pipes', 'assignment_1',
+            './build/combiner < {input}',
+            None, None, False),
+    Variant('pipes-binary', 'assignment_1',
+            './build/combiner -b -m 2 -r 2 < {input}',
+            None, None, False),
+    # With one mapper, -z splices the input file straight into its pipe, so
+    # io_uring (-i) only gets used with several mappers.
+    Variant('pipes-zerocopy', 'assignment_1',
+            './build/combiner -z < {input}',
+            None, None, False),
+    Variant('pipes-uring', 'assignment_1',
+            './build/combiner -i -m 2 -r 2 < {input}',
+            None, None, False),
+    Variant('pipes-memfd', 'assignment_1',
+            './build/combiner -f -m 2 -r 2 < {input}',
+            None, None, False),
+    Variant('pthreads', 'assignment_2',
+            './build/main 64 4 {input}',
+            None, None, False),
+    Variant('shm', 'assignment_4',
+            './a4 100 4 < {input}',
+            None, None, False),
+]
+
+Result = namedtuple('Result', 'wall first_byte maxrss output status')
+
+
+def user_ids(rng, num_users):
+    """Distinct IDs without leading zeros, since some variants parse them as
+    integers and print them back."""
+    ids = set()
+    while len(ids) < num_users:
+        ids.add(str(rng.randrange(1000, 10000000)))
+    ids = sorted(ids)
+    rng.shuffle(ids)
+    return ids
+
+
+def generate(path, num_records, skew, seed):
+    """
+    Write a workload of num_records tuples, one per line, grouped by user as
+    every reducer expects. With 'uniform', users get about 50 tuples each;
+    with 'zipf', the number of tuples per user follows a Zipf distribution,
+    so a few users get most of them.
+
+    Returns the expected totals as a dict of (id, topic) -> score, and the
+    number of users.
+    """
+    rng = random.Random(seed)
+    num_users = max(1, num_records // 50)
+    ids = user_ids(rng, num_users)
+
+    if skew == 'uniform':
+        weights = None
+    else:
+        weights = [1 / (rank + 1) ** 1.2 for rank in range(num_users)]
+
+    per_user = [0] * num_users
+    for user in rng.choices(range(num_users), weights=weights, k=num_records):
+        per_user[user] += 1
+
+    # Users also favour a few topics each.
+    topic_weights = [1 / (rank + 1) for rank in range(len(TOPICS))]
+    actions = list(ACTIONS)
+
+    totals = {}
+    lines = []
+    for user, count in enumerate(per_user):
+        id_ = ids[user]
+        topics = rng.sample(TOPICS, len(TOPICS))
+        for topic in rng.choices(topics, weights=topic_weights, k=count):
+            action = rng.choice(actions)
+            lines.append(f'({id_},{action},{topic})\n')
+            totals[(id_, topic)] = totals.get((id_, topic), 0) + ACTIONS[action]
+
+    with open(path, 'w') as f:
+        f.writelines(lines)
+
+    return totals, sum(1 for count in per_user if count)
+
+
+TUPLE_RE = re.compile(r'\(\s*([^,\s]+)\s*,\s*([^,\s]+)\s*,\s*(-?\d+)\s*\)')
+
+
+def parse_output(output):
+    """The tuples a variant printed, sorted, in a form every variant can be
+    compared in. Lines that aren't tuples (e.g. "Done.") are ignored. A key
+    printed twice stays twice, so it never matches the expected totals."""
+    return sorted((id_, topic, int(score)) for id_, topic, score
+                  in TUPLE_RE.findall(output.decode(errors='replace')))
+
+
+def run(variant, input_path, scratch, timeout):
+    """Run a variant once, timing it from start to its first output byte and
+    to its exit. Peak RSS is measured by bench/build/measure (see measure.c).
+
+    The variant runs in its own process group, which is killed when its main
+    process exits, so children it left behind (e.g. after an error) can't keep
+    the output open. It is also killed after timeout seconds."""
+    if variant.input_txt:
+        cwd = scratch
+        shutil.copyfile(input_path, os.path.join(scratch, 'input.txt'))
+    else:
+        cwd = os.path.join(ROOT, variant.cwd)
+
+    cmd = variant.cmd.format(input=input_path, root=ROOT)
+
+    start = time.perf_counter()
+    errors = tempfile.TemporaryFile()
+    proc = subprocess.Popen([MEASURE, cmd], cwd=cwd, stdin=subprocess.DEVNULL,
+                            stdout=subprocess.PIPE, stderr=errors,
+                            start_new_session=True)
+    out_fd = proc.stdout.fileno()
+
+    first_byte = None
+    chunks = []
+    status = None
+    timed_out = False
+
+    def read_output():
+        nonlocal first_byte
+        chunk = os.read(out_fd, 1 << 16)
+        if chunk and first_byte is None:
+            first_byte = time.perf_counter() - start
+        chunks.append(chunk)
+        return chunk
+
+    while status is None:
+        if select.select([out_fd], [], [], 0.05)[0] and not read_output():
+            # End of output: the variant is finishing.
+            _, status = os.waitpid(proc.pid, 0)
+            break
+
+        pid, status = os.waitpid(proc.pid, os.WNOHANG)
+        if pid == 0:
+            status = None
+            if time.perf_counter() - start > timeout:
+                os.killpg(proc.pid, signal.SIGKILL)
+                timed_out = True
+
+    wall = time.perf_counter() - start
+
+    # Anything still running in the group was left behind by the main process
+    # and could hold the output open forever.
+    try:
+        os.killpg(proc.pid, signal.SIGKILL)
+    except ProcessLookupError:
+        pass
+    while read_output():
+        pass
+    proc.stdout.close()
+
+    proc.returncode = os.waitstatus_to_exitcode(status)
+    if timed_out:
+        status = 'timeout'
+    else:
+        status = proc.returncode
+
+    errors.seek(0)
+    maxrss = re.findall(rb'^maxrss (\d+)$', errors.read(), re.MULTILINE)
+    maxrss = int(maxrss[-1]) if maxrss else None
+    errors.close()
+
+    return Result(wall, first_byte, maxrss, b''.join(chunks), status)
+
+
+def bench(variant, workload, input_path, expected, args, scratch):
+    """Run a variant args.repeat times and keep its fastest run. Returns a row
+    for the report."""
+    name, num_records, num_users = workload
+    row = {'workload': name, 'variant': variant.name}
+
+    if variant.max_records is not None and num_records > variant.max_records:
+        row['check'] = 'skip'
+        return row
+    if variant.max_users is not None and num_users > variant.max_users:
+        row['check'] = 'skip'
+        return row
+
+    expected_tuples = sorted((id_, topic, score)
+                             for (id_, topic), score in expected.items())
+
+    best = None
+    for _ in range(args.repeat):
+        result = run(variant, input_path, scratch, args.timeout)
+        if result.status == 'timeout':
+            row['check'] = 'timeout'
+            return row
+        if result.status != 0:
+            row['check'] = f'exit {result.status}'
+            return row
+        if parse_output(result.output) != expected_tuples:
+            row['check'] = 'MISMATCH'
+            return row
+        if best is None or result.wall < best.wall:
+            best = result
+
+    row['check'] = 'ok'
+    row['throughput'] = num_records / best.wall
+    row['first_byte'] = best.first_byte
+    row['wall'] = best.wall
+    row['maxrss'] = best.maxrss
+    return row
+
+
+def format_row(row):
+    if row['check'] != 'ok':
+        return (f"{row['workload']:<16} {row['variant']:<16} "
+                f"{'-':>12} {'-':>10} {'-':>10} {'-':>9}  {row['check']}")
+
+    first_byte = row['first_byte']
+    first_byte = f'{first_byte * 1000:.1f}' if first_byte is not None else '-'
+    return (f"{row['workload']:<16} {row['variant']:<16} "
+            f"{row['throughput']:>12,.0f} {first_byte:>10} "
+            f"{row['wall'] * 1000:>10.1f} {row['maxrss'] / 1024:>9.1f}  ok")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n\n')[1])
+    parser.add_argument('--sizes', type=int, nargs='+',
+                        default=[100, 1000, 100000, 1000000],
+                        help='workload sizes, in tuples')
+    parser.add_argument('--skews', nargs='+', choices=['uniform', 'zipf'],
+                        default=['uniform', 'zipf'],
+                        help='how tuples are spread over users')
+    parser.add_argument('--variants', nargs='+',
+                        choices=[variant.name for variant in VARIANTS],
+                        default=[variant.name for variant in VARIANTS],
+                        help='implementations to run')
+    parser.add_argument('--repeat', type=int, default=3,
+                        help='runs per variant; the fastest is reported')
+    parser.add_argument('--timeout', type=float, default=300,
+                        help='seconds before a run is killed')
+    parser.add_argument('--seed', type=int, default=1)
+    args = parser.parse_args()
+
+    variants = [variant for variant in VARIANTS if variant.name in args.variants]
+    failed = False
+
+    print(f"{'workload':<16} {'variant':<16} {'tuples/s':>12} "
+          f"{'first ms':>10} {'wall ms':>10} {'RSS MiB':>9}  check")
+
+    with tempfile.TemporaryDirectory(prefix='bench-') as tmp:
+        scratch = os.path.join(tmp, 'scratch')
+        os.mkdir(scratch)
+
+        for size in args.sizes:
+            for skew in args.skews:
+                input_path = os.path.join(tmp, f'{skew}-{size}.txt')
+                expected, num_users = generate(input_path, size, skew, args.seed)
+                workload = (f'{skew}-{size}', size, num_users)
+
+                for variant in variants:
+                    row = bench(variant, workload, input_path, expected,
+                                args, scratch)
+                    failed |= row['check'] not in ('ok', 'skip')
+                    print(format_row(row), flush=True)
+
+                os.remove(input_path)
+
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
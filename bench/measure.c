@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/*
+ * Runs a shell command and prints its peak RSS, in KiB, to stderr as
+ * "maxrss <KiB>" once it exits. The peak is the largest of the command and
+ * every process it waited for.
+ *
+ * The benchmark could get this from wait4() itself, but a process keeps the
+ * peak RSS of whatever it exec()'d from, so every command run straight from
+ * the benchmark would report at least the Python interpreter's size. Forked
+ * from this small process instead, it reports its own.
+ *
+ * Exits with the command's status.
+ */
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: measure <command>\n");
+        exit(EXIT_FAILURE);
+    }
+
+    const pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+
+    if (pid == 0)
+    {
+        execl("/bin/sh", "sh", "-c", argv[1], (char *)NULL);
+        perror("execl");
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) == -1)
+    {
+        perror("wait4");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stderr, "maxrss %ld\n", usage.ru_maxrss);
+
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return WEXITSTATUS(status);
+}
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+ * @brief Flat open-addressing table from a (user, topic) pair to a score.
+ *
+ * Users and topics are interned to 32-bit IDs by the caller and packed into
+ * one 64-bit key, so each update is a single hash probe into one contiguous
+ * array with no per-user allocation.
+ *
+ * Slots are probed linearly in groups of 16. A separate control byte per slot
+ * holds either EMPTY or 7 bits of the key's hash (the tag), so a whole group
+ * is checked for candidates with one SSE2 compare. Keys are never removed
+ * individually, which keeps probing free of tombstones.
+ */
+class flat_score_table {
+   public:
+    using key_type = uint64_t;
+    using score_type = int;
+
+    struct entry {
+        key_type key;
+        score_type score;
+    };
+
+    static key_type make_key(uint32_t user, uint32_t topic) {
+        return (key_type)user << 32 | topic;
+    }
+    static uint32_t key_user(key_type key) { return key >> 32; }
+    static uint32_t key_topic(key_type key) { return (uint32_t)key; }
+
+    /**
+     * @brief Mix the bits of a 64-bit value (murmur3 finalizer). Also
+     * useful to callers for partitioning by user.
+     */
+    static uint64_t mix(uint64_t x) {
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdULL;
+        x ^= x >> 33;
+        x *= 0xc4ceb9fe1a85ec53ULL;
+        x ^= x >> 33;
+        return x;
+    }
+
+    explicit flat_score_table(size_t expected = 0) { rehash(expected); }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    /**
+     * @brief Add to the score of a key, inserting it at 0 first if needed.
+     */
+    void add(key_type key, score_type score) {
+        find_or_insert(key).score += score;
+    }
+
+    void add(uint32_t user, uint32_t topic, score_type score) {
+        add(make_key(user, topic), score);
+    }
+
+    /**
+     * @brief Add every entry of another table into this one.
+     */
+    void merge(const flat_score_table &other) {
+        other.for_each(
+            [this](key_type key, score_type score) { add(key, score); });
+    }
+
+    /**
+     * @brief Call f(key, score) for every entry, in slot order.
+     */
+    template <typename F>
+    void for_each(F f) const {
+        for (size_t i = 0; i < slots.size(); i++) {
+            if (ctrl[i] != EMPTY) f(slots[i].key, slots[i].score);
+        }
+    }
+
+    /**
+     * @brief Remove every entry, keeping the allocated capacity.
+     */
+    void clear() {
+        std::memset(ctrl.data(), EMPTY, ctrl.size());
+        count = 0;
+    }
+
+    void swap(flat_score_table &other) {
+        ctrl.swap(other.ctrl);
+        slots.swap(other.slots);
+        std::swap(group_mask, other.group_mask);
+        std::swap(count, other.count);
+    }
+
+   private:
+    static constexpr size_t GROUP_SIZE = 16;
+    static constexpr int8_t EMPTY = -128;  // High bit set; tags never have it.
+
+    std::vector<int8_t> ctrl;  // One control byte per slot.
+    std::vector<entry> slots;
+    size_t group_mask = 0;  // Number of groups - 1.
+    size_t count = 0;
+
+    // Bit i is set if ctrl[pos + i] == byte.
+    static uint32_t match(const int8_t *group, int8_t byte) {
+#ifdef __SSE2__
+        const auto ctrl_bytes =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+        return _mm_movemask_epi8(
+            _mm_cmpeq_epi8(ctrl_bytes, _mm_set1_epi8(byte)));
+#else
+        uint32_t mask = 0;
+        for (size_t i = 0; i < GROUP_SIZE; i++) {
+            mask |= (uint32_t)(group[i] == byte) << i;
+        }
+        return mask;
+#endif
+    }
+
+    entry &find_or_insert(key_type key) {
+        const auto hash = mix(key);
+        const int8_t tag = hash & 0x7f;
+
+        for (size_t g = (hash >> 7) & group_mask;; g = (g + 1) & group_mask) {
+            const auto pos = g * GROUP_SIZE;
+            const auto group = &ctrl[pos];
+
+            for (auto m = match(group, tag); m; m &= m - 1) {
+                auto &slot = slots[pos + __builtin_ctz(m)];
+                if (slot.key == key) return slot;
+            }
+
+            // An empty slot ends the probe: the key isn't in the table.
+            const auto empties = match(group, EMPTY);
+            if (!empties) continue;
+
+            // Keep the load factor at or below 7/8.
+            if ((count + 1) * 8 > slots.size() * 7) {
+                rehash(slots.size());
+                return find_or_insert(key);
+            }
+
+            const auto i = pos + __builtin_ctz(empties);
+            ctrl[i] = tag;
+            slots[i] = entry{key, 0};
+            count++;
+            return slots[i];
+        }
+    }
+
+    // Grow to the next power of two number of groups that holds at least
+    // twice min_entries, and re-insert everything.
+    void rehash(size_t min_entries) {
+        size_t num_groups = 1;
+        while (num_groups * GROUP_SIZE < 2 * min_entries) num_groups *= 2;
+
+        // Swap in the new, empty arrays; old_* keep the current contents.
+        std::vector<int8_t> old_ctrl(num_groups * GROUP_SIZE, EMPTY);
+        std::vector<entry> old_slots(num_groups * GROUP_SIZE);
+        ctrl.swap(old_ctrl);
+        slots.swap(old_slots);
+        group_mask = num_groups - 1;
+        count = 0;
+
+        for (size_t i = 0; i < old_slots.size(); i++) {
+            if (old_ctrl[i] != EMPTY) {
+                find_or_insert(old_slots[i].key).score = old_slots[i].score;
+            }
+        }
+    }
+};